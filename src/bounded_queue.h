@@ -0,0 +1,105 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_BOUNDED_QUEUE_H
+#define SPEEDBOOST_BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace speedboost {
+
+/**
+ * Fixed capacity FIFO queue for handing items between threads.
+ * Push blocks while the queue is full and Pop blocks while it is
+ * empty, until the queue is closed.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity)
+    : capacity_(capacity), closed_(false) {
+  }
+
+  /**
+   * Add item to the back of the queue, waiting for space if needed.
+   * Returns false (dropping the item) if the queue has been closed.
+   */
+  bool Push(T&& item) {
+    std::unique_lock<std::mutex> lock(lock_);
+    while (items_.size() >= capacity_ && !closed_) {
+      not_full_.wait(lock);
+    }
+    if (closed_)
+      return false;
+
+    items_.push_back(std::move(item));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /**
+   * Take the item at the front of the queue, waiting for one if needed.
+   * Returns false once the queue is closed and empty.
+   */
+  bool Pop(T* item) {
+    std::unique_lock<std::mutex> lock(lock_);
+    while (items_.empty() && !closed_) {
+      not_empty_.wait(lock);
+    }
+    if (items_.empty())
+      return false;
+
+    *item = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  /**
+   * Stop accepting items and wake up any waiting threads.  Items
+   * already in the queue can still be popped.
+   */
+  void Close() {
+    std::lock_guard<std::mutex> lock(lock_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+  /**
+   * Close the queue and drop everything in it.
+   */
+  void Clear() {
+    std::lock_guard<std::mutex> lock(lock_);
+    closed_ = true;
+    items_.clear();
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+  size_t capacity() const { return capacity_; }
+
+private:
+  // Not copyable.
+  BoundedQueue(const BoundedQueue&);
+  BoundedQueue& operator=(const BoundedQueue&);
+
+  size_t capacity_;
+  bool closed_;
+  std::deque<T> items_;
+
+  std::mutex lock_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_BOUNDED_QUEUE_H
@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <cfloat>
 #include <cmath>
+#include <utility>
 
 #include "classifier.h"
 #include "classifier.pb.h"
@@ -24,6 +25,30 @@ DEFINE_double(target_false_negative, 0.005, "Desired false negative rate per cas
 DEFINE_double(target_false_positive_base, 0.85, "Desired false positive rate per casacade stage (base).");
 DEFINE_double(target_false_positive_step, 0.05, "Desired false positive rate per casacade stage (step).");
 DEFINE_bool(sample_patches, false, "Sample the loaded patches using the gradient as a weighted sample.");
+DEFINE_bool(lazy_feature_selection, false,
+            "Only re-evaluate the features whose loss could still beat the best one "
+            "each round.  Selects the same features as the full search.");
+DEFINE_bool(bandit_feature_selection, false,
+            "Select features approximately by estimating their errors on growing weighted "
+            "samples and eliminating the worst ones early.  See the bandit_* flags.");
+DEFINE_bool(goss, false,
+            "Select each feature using only the examples with the largest weights plus a "
+            "reweighted random sample of the rest (gradient-based one-side sampling).");
+DEFINE_double(goss_top_fraction, 0.2, "Fraction of largest weight examples always kept by goss.");
+DEFINE_double(goss_other_fraction, 0.1, "Fraction of examples randomly sampled from the rest by goss.");
+DEFINE_double(weight_trim_mass, 0.0,
+              "If positive, skip the lowest weight examples making up at most this fraction of "
+              "the total weight when selecting features (weight trimming).");
+DEFINE_int32(weight_trim_interval, 10,
+             "Number of rounds between recomputing the trimmed examples.  They are also "
+             "recomputed as soon as the trimmed examples hold twice weight_trim_mass.");
+DEFINE_bool(reuse_selector, false,
+            "Keep the feature selector between resampling rounds and only replace a fraction "
+            "of the training patches each round, instead of rebuilding it from scratch.  "
+            "Ignored if sample_patches is true.");
+DEFINE_double(replace_fraction, 0.25,
+              "Fraction of positive and negative training patches replaced each round "
+              "when reuse_selector is true.");
 
 namespace speedboost {
 
@@ -32,6 +57,11 @@ float DecisionStump::Evaluate(const Patch& p) const
   return Evaluate(base_.Evaluate(p));
 }
 
+float DecisionStump::Evaluate(const PatchBatch& patches, int i) const
+{
+  return Evaluate(base_.Evaluate(patches, i));
+}
+
 float DecisionStump::Evaluate(float response) const
 {
   // cout << "response: " << response << endl;
@@ -352,6 +382,50 @@ float ExpLoss(const vector<Patch>& patches,
   return loss;
 }
 
+void ComputeLosses(const vector<char>& labels, const vector<float>& sample_weights,
+                   const vector<float>& activations, LossStatistics* stats) {
+  bool use_sample_weights = (sample_weights.size() == activations.size());
+  int num_patches = labels.size();
+
+  double exp_loss = 0.0;
+  double positive_count = 0.0;
+  double negative_count = 0.0;
+  double positive_errors = 0.0;
+  double negative_errors = 0.0;
+
+  #pragma omp parallel for schedule(static) \
+    reduction(+:exp_loss, positive_count, negative_count, positive_errors, negative_errors)
+  for (int i = 0; i < num_patches; i++) {
+    float s = use_sample_weights ? sample_weights[i] : 1.0f;
+    float a = activations[i];
+
+    if (labels[i] > 0) {
+      exp_loss += s * FastExp(-a);
+      positive_count += s;
+      positive_errors += (a > 0) ? 0.0f : s;
+    } else {
+      exp_loss += s * FastExp(a);
+      negative_count += s;
+      negative_errors += (a > 0) ? s : 0.0f;
+    }
+  }
+
+  stats->exp_loss = exp_loss;
+  stats->zero_one_loss = (positive_errors + negative_errors) / (positive_count + negative_count);
+  stats->positive_loss = positive_errors / positive_count;
+  stats->negative_loss = negative_errors / negative_count;
+}
+
+void ComputeLosses(const vector<Patch>& patches, const vector<float>& sample_weights,
+                   const vector<float>& activations, LossStatistics* stats) {
+  vector<char> labels(patches.size());
+  for (unsigned int p = 0; p < patches.size(); p++) {
+    labels[p] = patches[p].label();
+  }
+
+  ComputeLosses(labels, sample_weights, activations, stats);
+}
+
 void Gradient(const vector<Patch> &patches, const vector<float>& sample_weights,
 	      const vector<float> activations, vector<float>* weights) {
   if (sample_weights.size() == activations.size()) {
@@ -415,6 +489,102 @@ float Classifier::Activation(const Patch& patch) const {
   return activation;
 }
 
+float Classifier::ResumeActivation(const Patch& patch, ActivationState* state) const {
+  int num_chains = chains_.size();
+
+  // Start over if the state can't have come from this classifier.
+  if (state->chain > num_chains ||
+      (state->chain == num_chains && state->stump > 0) ||
+      (state->chain < num_chains && state->stump > (int)chains_[state->chain].stumps_.size())) {
+    *state = ActivationState();
+  }
+
+  if (state->stopped)
+    return state->activation;
+
+  float activation = state->activation;
+  int i = state->chain;
+  int j = state->stump;
+  while (i < num_chains) {
+    const Chain& chain = chains_[i];
+
+    if (j == 0) {
+      float v = (filters_use_margin_) ? abs(activation) : activation;
+      if (!filters_[i].PassesFilter(v)) {
+        if (filters_are_permanent_) {
+          state->stopped = true;
+          break;
+        }
+        i++;
+        continue;
+      }
+
+      bool reset = filters_[i].active_ && !filters_are_additive_;
+
+      // The filter of an empty last chain may still be changed, so
+      // stop before it and check it again next time.
+      if (chain.stumps_.empty() && i == num_chains - 1) {
+        state->activation = activation;
+        state->chain = i;
+        state->stump = 0;
+        return reset ? 0.0 : activation;
+      }
+
+      if (reset) {
+	activation = 0.0;
+      }
+    }
+
+    for (; j < (int)chain.stumps_.size(); j++) {
+      activation += chain.weights_[j] * chain.stumps_[j].Evaluate(patch);
+    }
+
+    // Stumps may still be added to the last chain.
+    if (i == num_chains - 1)
+      break;
+
+    i++;
+    j = 0;
+  }
+
+  state->activation = activation;
+  state->chain = i;
+  state->stump = j;
+  return activation;
+}
+
+ActivationCache::ActivationCache(size_t max_size)
+  : classifier_(NULL), max_size_(max_size), states_(), hits_(0) {
+}
+
+float ActivationCache::Activation(const Patch& p, const Classifier& c) {
+  if (&c != classifier_) {
+    Clear();
+    classifier_ = &c;
+  }
+
+  if (p.id() < 0)
+    return c.Activation(p);
+
+  unordered_map<int64_t, ActivationState>::iterator it = states_.find(p.id());
+  if (it == states_.end()) {
+    if (states_.size() >= max_size_)
+      return c.Activation(p);
+
+    it = states_.insert(make_pair(p.id(), ActivationState())).first;
+  } else {
+    hits_++;
+  }
+
+  return c.ResumeActivation(p, &it->second);
+}
+
+void ActivationCache::Clear() {
+  states_.clear();
+  classifier_ = NULL;
+  hits_ = 0;
+}
+
 bool Classifier::IsActiveInLastChain(const Patch& patch) const {
   float activation = 0;
   bool active = true;
@@ -440,21 +610,18 @@ bool Classifier::IsActiveInLastChain(const Patch& patch) const {
   return active;
 }
 
-float ComputePredictionBias(const vector<Patch> &patches, const vector<float> activations,
+/**
+ * Find the bias that keeps the false negative rate of the patches at
+ * most false_negative_rate, given the order of their activations.
+ */
+float ComputePredictionBias(const vector<Patch> &patches, const vector<float>& activations,
+                            const vector<int>& order,
                             float false_negative_rate, float* false_positive_rate) {
-  vector< pair<float, char> > sortable(patches.size());
-  for (unsigned int p = 0; p < patches.size(); p++) {
-    sortable[p].first = activations[p];
-    sortable[p].second = patches[p].label();
-  }
-
-  sort(sortable.begin(), sortable.end());
-
   int positives = 0;
   int negatives = 0;
 
   for (unsigned int p = 0; p < patches.size(); p++) {
-    if (sortable[p].second > 0) {
+    if (patches[p].label() > 0) {
       positives++;
     } else {
       negatives++;
@@ -467,19 +634,22 @@ float ComputePredictionBias(const vector<Patch> &patches, const vector<float> ac
   float bias = 0.0;
   *false_positive_rate = 1.0;
 
-  for (unsigned int p = 0; p < patches.size(); p++) {
-    if (sortable[p].second > 0) {
+  for (unsigned int k = 0; k + 1 < order.size(); k++) {
+    int p1 = order[k];
+    int p2 = order[k + 1];
+
+    if (patches[p1].label() > 0) {
       false_negatives++;
     } else {
       false_positives--;
     }
 
-    if (sortable[p].first == sortable[p + 1].first) continue;
+    if (activations[p1] == activations[p2]) continue;
 
     if (false_negatives / ((float)positives) > false_negative_rate) {
       break;
     } else {
-      bias = (sortable[p].first + sortable[p + 1].first) / 2.0;
+      bias = (activations[p1] + activations[p2]) / 2.0;
       *false_positive_rate = (false_positives / ((float)negatives));
     }
   }
@@ -487,41 +657,129 @@ float ComputePredictionBias(const vector<Patch> &patches, const vector<float> ac
   return bias;
 }
 
+float ComputePredictionBias(const vector<Patch> &patches, const vector<float> activations,
+                            float false_negative_rate, float* false_positive_rate) {
+  vector<int> order(activations.size());
+  vector<unsigned int> scratch;
+  if (!activations.empty()) {
+    RadixArgsort(&activations[0], activations.size(), &order[0], &scratch);
+  }
+
+  return ComputePredictionBias(patches, activations, order, false_negative_rate, false_positive_rate);
+}
+
+/**
+ * Re-sort order after the activations were updated by a single stump, as
+ * recorded in changes by UpdateSingleStump.  Adding the same weight to a
+ * set of activations keeps them in order, so the new order is just a merge
+ * of the unchanged, increased and decreased runs of the old one.  Only if
+ * a filter reset some activations is it sorted from scratch.
+ */
+void UpdateSortedOrder(const vector<float>& activations, const vector<char>& changes,
+                       vector<int>* order) {
+  int num_patches = activations.size();
+
+  vector<int> runs[3];
+  for (int k = 0; k < num_patches; k++) {
+    int p = (*order)[k];
+    if (changes[p] == 2) {
+      vector<unsigned int> scratch;
+      RadixArgsort(&activations[0], num_patches, &(*order)[0], &scratch);
+      return;
+    }
+    runs[changes[p] + 1].push_back(p);
+  }
+
+  // Three way merge of the decreased, unchanged and increased runs.
+  unsigned int next[3] = {0, 0, 0};
+  for (int k = 0; k < num_patches; k++) {
+    int best = -1;
+    for (int r = 0; r < 3; r++) {
+      if (next[r] < runs[r].size() &&
+          (best < 0 || activations[runs[r][next[r]]] < activations[runs[best][next[best]]])) {
+        best = r;
+      }
+    }
+    (*order)[k] = runs[best][next[best]++];
+  }
+}
+
 void TrainStages(const vector<Patch>& patches, const vector<float>& sample_weights,
-		 const vector<Feature>& features,
+		 FeatureSelector& selector,
 		 int max_num_stages, bool calc_weights, bool use_rates,
 		 float false_negative_rate, float false_positive_rate,
 		 const vector<Patch>& validation, Classifier* c) {
-  FeatureSelector selector(patches, features);
-
   vector<float> weights(patches.size(), 1.0);
   vector<float> activations(patches.size(), 0.0);
 
+  // Validation activations and filter status for the classifier so far,
+  // updated one stump at a time, along with their sorted order.
   vector<float> validation_activations(validation.size(), 0.0);
+  vector<bool> validation_updated(validation.size(), true);
+  vector<char> validation_changes(validation.size(), 0);
+  vector<int> validation_order(validation.size());
 
-  float positive_loss, negative_loss;
+  for (unsigned int ci = 0; ci < c->chains_.size(); ci++) {
+    for (unsigned int cj = 0; cj < c->chains_[ci].stumps_.size(); cj++) {
+      UpdateSingleStump(validation, *c, ci, cj, &validation_activations, &validation_updated);
+    }
+  }
+  if (!validation.empty()) {
+    vector<unsigned int> scratch;
+    RadixArgsort(&validation_activations[0], validation.size(), &validation_order[0], &scratch);
+  }
+
+  LossStatistics stats;
 
   Chain *last_chain = &(c->chains_.back());
 
   // If anytime boosting, don't throw away gradient.
   if (calc_weights) {
+    #pragma omp parallel for schedule(static)
     for (unsigned int p = 0; p < patches.size(); p++) {
       activations[p] = Activation(patches[p], *c);
     }
     Gradient(patches, sample_weights, activations, &weights);
   }
 
+  ComputeLosses(patches, sample_weights, activations, &stats);
   cout << "Initial" << endl;
-  cout << "exp loss: " << ExpLoss(patches, sample_weights, activations)
-       << ", 0/1 loss: " << ZeroOneLoss(patches, sample_weights, activations,
-                                        &positive_loss, &negative_loss) << endl;
-  cout << "+ err: " << positive_loss << ", - err: " << negative_loss << endl;
+  cout << "exp loss: " << stats.exp_loss << ", 0/1 loss: " << stats.zero_one_loss << endl;
+  cout << "+ err: " << stats.positive_loss << ", - err: " << stats.negative_loss << endl;
+
+  int last_trim = -FLAGS_weight_trim_interval;
+  long long trim_scanned = 0;
+  long long trim_total = 0;
 
   float bias;
   for (int i = 0; i < max_num_stages; i++) {
     int index;
     float err;
 
+    if (FLAGS_weight_trim_mass > 0.0) {
+      double trimmed_weight = 0.0;
+      double total_weight = 0.0;
+      for (unsigned int p = 0; p < patches.size(); p++) {
+        total_weight += weights[p];
+        if (!selector.IsActive(p))
+          trimmed_weight += weights[p];
+      }
+
+      if (i - last_trim >= FLAGS_weight_trim_interval ||
+          trimmed_weight > 2.0 * FLAGS_weight_trim_mass * total_weight) {
+        vector<int> active;
+        TrimWeights(weights, FLAGS_weight_trim_mass, &active);
+        selector.SetActiveExamples(active);
+        last_trim = i;
+      }
+
+      trim_scanned += selector.num_active();
+      trim_total += patches.size();
+      cout << "Weight trimming: selecting on " << selector.num_active() << " of "
+           << patches.size() << " examples, "
+           << 100.0 * (trim_total - trim_scanned) / trim_total << "% of examples skipped so far." << endl;
+    }
+
     // cout << "weights: " << endl;
     // for (unsigned int j = 0; j < weights.size(); j++) {
     //   cout << " " << weights[j];
@@ -542,19 +800,38 @@ void TrainStages(const vector<Patch>& patches, const vector<float>& sample_weigh
 	filt.active_ = true;
       }
       filt.less_ = true;
+    } else if (FLAGS_lazy_feature_selection) {
+      feat = selector.SelectFeatureLazy(weights, activations, &index, &err);
+    } else if (FLAGS_bandit_feature_selection) {
+      feat = selector.SelectFeatureBandit(weights, activations, &index, &err);
+    } else if (FLAGS_goss) {
+      vector<int> subset;
+      vector<float> subset_weights;
+      GossSample(weights, FLAGS_goss_top_fraction, FLAGS_goss_other_fraction,
+                 &subset, &subset_weights);
+      cout << "GOSS selecting on " << subset.size() << " of " << weights.size() << " examples." << endl;
+      feat = selector.SelectFeatureSubset(subset, subset_weights, &index, &err);
     } else {
       feat = selector.SelectFeature(weights, activations, &index, &err);
     }
 
     float alpha = 0.5 * log( (1 - err) / err );
 
-    float fpr;
-    bias = ComputePredictionBias(validation, validation_activations, false_negative_rate, &fpr);
+    // No bias until a stump has been added in this call.
+    float fpr = 1.0;
+    bias = 0.0;
+    if (i > 0) {
+      bias = ComputePredictionBias(validation, validation_activations, validation_order,
+                                   false_negative_rate, &fpr);
+    }
 
     last_chain->stumps_.push_back(feat);
     last_chain->weights_.push_back(alpha);
     last_chain->biases_.push_back(bias);
 
+    int chain_index = c->chains_.size() - 1;
+    int stump_index = last_chain->stumps_.size() - 1;
+
     if (FLAGS_anytime_boost) {
       // Set filter and add a new chain for the next feature.
       c->filters_.back() = filt;
@@ -564,8 +841,7 @@ void TrainStages(const vector<Patch>& patches, const vector<float>& sample_weigh
       last_chain = &(c->chains_.back());
     }
 
-    selector.UpdateActivations(feat, filt, index, alpha, &activations);
-    Gradient(patches, sample_weights, activations, &weights);
+    selector.UpdateRound(feat, filt, index, alpha, sample_weights, &activations, &weights, &stats);
 
     cout << endl << "Iteration " << i << endl;
     cout <<         "-------------" << endl;
@@ -579,20 +855,17 @@ void TrainStages(const vector<Patch>& patches, const vector<float>& sample_weigh
     cout << endl << "alpha: " << alpha << endl;
 
     cout << endl;
-    cout << "exp loss: " << ExpLoss(patches, sample_weights, activations)
-         << ", 0/1 loss: " << ZeroOneLoss(patches, sample_weights, activations,
-                                          &positive_loss, &negative_loss) << endl;
-    cout << "+ err: " << positive_loss << ", - err: " << negative_loss << endl;
+    cout << "exp loss: " << stats.exp_loss << ", 0/1 loss: " << stats.zero_one_loss << endl;
+    cout << "+ err: " << stats.positive_loss << ", - err: " << stats.negative_loss << endl;
 
     cout << "validation activations: " << validation_activations.size() << endl;
-    for (unsigned int p = 0; p < validation.size(); p++) {
-      validation_activations[p] = Activation(validation[p], *c);
-    }
+    UpdateSingleStump(validation, *c, chain_index, stump_index,
+                      &validation_activations, &validation_updated, &validation_changes);
+    UpdateSortedOrder(validation_activations, validation_changes, &validation_order);
 
-    cout << "exp loss: " << ExpLoss(validation, validation_activations)
-         << ", 0/1 loss: " << ZeroOneLoss(validation, validation_activations,
-                                          &positive_loss, &negative_loss) << endl;
-    cout << "+ err: " << positive_loss << ", - err: " << negative_loss << endl;
+    ComputeLosses(validation, vector<float>(), validation_activations, &stats);
+    cout << "exp loss: " << stats.exp_loss << ", 0/1 loss: " << stats.zero_one_loss << endl;
+    cout << "+ err: " << stats.positive_loss << ", - err: " << stats.negative_loss << endl;
 
     cout << "To achieve + err of " << false_negative_rate << ": - err = " << fpr
          << ", bias = " << bias << endl;
@@ -604,6 +877,8 @@ void TrainStages(const vector<Patch>& patches, const vector<float>& sample_weigh
       break;
     }
   }
+
+  selector.ClearActiveExamples();
 }
 
 void TrainCascade(DataSource& data,
@@ -691,7 +966,8 @@ void TrainCascade(DataSource& data,
       break;
     }
 
-    TrainStages(patches, vector<float>(), features, FLAGS_max_inner_stages, false, true,
+    FeatureSelector selector(patches, features);
+    TrainStages(patches, vector<float>(), selector, FLAGS_max_inner_stages, false, true,
 		FLAGS_target_false_negative,
 		FLAGS_target_false_positive_base - i*FLAGS_target_false_positive_step,
 		validation, c);
@@ -704,6 +980,36 @@ void TrainCascade(DataSource& data,
   }
 }
   
+/**
+ * Replace a random fraction of the positive (or negative) patches with new
+ * ones read from data, updating the selector to match.  Returns the number
+ * of patches replaced.
+ */
+int ReplacePatches(DataSource& data, bool positive, float fraction,
+                   vector<Patch>* patches, FeatureSelector* selector) {
+  vector<int> candidates;
+  for (unsigned int p = 0; p < patches->size(); p++) {
+    if (((*patches)[p].label() > 0) == positive) {
+      candidates.push_back(p);
+    }
+  }
+  random_shuffle(candidates.begin(), candidates.end());
+
+  int num_replace = (int)(fraction * candidates.size());
+  vector<Patch> fresh;
+  int num_read = positive ?
+    data.GetPositivePatches(num_replace, &fresh) :
+    data.GetNegativePatches(num_replace, &fresh);
+
+  vector<int> slots(candidates.begin(), candidates.begin() + num_read);
+  for (int i = 0; i < num_read; i++) {
+    (*patches)[slots[i]] = fresh[i];
+  }
+  selector->ReplaceExamples(slots, fresh);
+
+  return num_read;
+}
+
 void TrainBoosted(DataSource& data, const std::vector<Feature>& features,
 		  int num_stages, int max_positives, int max_negatives, Classifier *c) {
   //  vector<Patch> positive_patches;
@@ -720,6 +1026,9 @@ void TrainBoosted(DataSource& data, const std::vector<Feature>& features,
     c->filters_are_permanent_ = false;
   }
 
+  bool reuse_selector = FLAGS_reuse_selector && !FLAGS_sample_patches;
+  FeatureSelector* selector = NULL;
+
   cout << "Initial" << endl;
 
   c->chains_.push_back(Chain());
@@ -729,13 +1038,25 @@ void TrainBoosted(DataSource& data, const std::vector<Feature>& features,
     cout << endl << "Stage " << i << endl;
     cout <<         "-------------" << endl;
 
-    patches.clear();
-    sample_weights.clear();
     validation.clear();
 
     int num_positive = 0;
     int num_negative = 0;
-    if (FLAGS_sample_patches) {
+    if (reuse_selector && selector) {
+      // Keep the selector, and swap in new patches for a fraction of the old ones.
+      num_positive = ReplacePatches(data, true, FLAGS_replace_fraction, &patches, selector);
+      num_negative = ReplacePatches(data, false, FLAGS_replace_fraction, &patches, selector);
+      cout << "Replaced " << num_positive << " positive patches." << endl;
+      cout << "Replaced " << num_negative << " negative patches." << endl;
+      if (num_positive == 0 && num_negative == 0) {
+        cout << "Unable to load positive or negative patches." << endl;
+        delete selector;
+        return;
+      }
+    } else if (FLAGS_sample_patches) {
+      patches.clear();
+      sample_weights.clear();
+
       data.GetPatchesSampled(max_positives + max_negatives, *c, &sample_weights, &patches);
       for (unsigned int p = 0; p < patches.size(); p++) {
       	if (patches[p].label() > 0)
@@ -746,14 +1067,19 @@ void TrainBoosted(DataSource& data, const std::vector<Feature>& features,
       //num_positive = data.GetPositivePatchesSampled(max_positives, *c, &sample_weights, &patches);
       //num_negative = data.GetNegativePatchesSampled(max_negatives, *c, &sample_weights, &patches);
     } else {
+      patches.clear();
       num_positive = data.GetPositivePatches(max_positives, &patches);
       num_negative = data.GetNegativePatches(max_negatives, &patches);
     }
-    cout << "Loaded " << num_positive << " positive patches." << endl;
-    cout << "Loaded " << num_negative << " negative patches." << endl;
-    if (num_positive == 0 || num_negative == 0) {
-      cout << "Unable to load positive or negative patches." << endl;
-      return;
+
+    if (!reuse_selector || !selector) {
+      cout << "Loaded " << num_positive << " positive patches." << endl;
+      cout << "Loaded " << num_negative << " negative patches." << endl;
+      if (num_positive == 0 || num_negative == 0) {
+        cout << "Unable to load positive or negative patches." << endl;
+        delete selector;
+        return;
+      }
     }
 
     int num_positive_validation = data.GetPositivePatches(max_positives, &validation);
@@ -766,9 +1092,19 @@ void TrainBoosted(DataSource& data, const std::vector<Feature>& features,
     //    patches.insert(patches.end(), positive_patches.begin(), positive_patches.end());
     //    patches.insert(patches.end(), negative_patches.begin(), negative_patches.end());
 
-    TrainStages(patches, sample_weights, features, FLAGS_stage_increment, true, false, 0.0, 0.0, validation, c);
+    if (!reuse_selector) {
+      FeatureSelector round_selector(patches, features);
+      TrainStages(patches, sample_weights, round_selector, FLAGS_stage_increment, true, false, 0.0, 0.0, validation, c);
+    } else {
+      if (!selector) {
+        selector = new FeatureSelector(patches, features);
+      }
+      TrainStages(patches, sample_weights, *selector, FLAGS_stage_increment, true, false, 0.0, 0.0, validation, c);
+    }
   }
 
+  delete selector;
+
   if (FLAGS_anytime_boost) {
     c->filters_.pop_back();
     c->chains_.pop_back();
@@ -799,9 +1135,21 @@ void UpdateSingleStage(const vector<Patch>& patches, const Classifier& c,
   }
 }
 
-void UpdateSingleStump(const vector<Patch>& patches, const Classifier& c,
-                       int i, int j, vector<float>* activations, vector<bool>* updated) {
-  for (unsigned int p = 0; p < patches.size(); p++) {
+/**
+ * Shared part of UpdateSingleStump, given the response of the stump's
+ * feature on each patch.  Responses are only needed for patches that
+ * have not been permanently filtered out.
+ */
+void ApplySingleStump(const Classifier& c, int i, int j, const vector<float>& responses,
+                      vector<float>* activations, vector<bool>* updated, vector<char>* changes) {
+  const DecisionStump& stump = c.chains_[i].stumps_[j];
+  float weight = c.chains_[i].weights_[j];
+
+  for (unsigned int p = 0; p < activations->size(); p++) {
+    if (changes) {
+      (*changes)[p] = 0;
+    }
+
     if (c.filters_are_permanent_ && !(*updated)[p]) {
       continue;
     }
@@ -812,6 +1160,9 @@ void UpdateSingleStump(const vector<Patch>& patches, const Classifier& c,
 	(*updated)[p] = true;
 	if (c.filters_[i].active_ && !c.filters_are_additive_) {
 	  (*activations)[p] = 0.0;
+          if (changes) {
+            (*changes)[p] = 2;
+          }
 	}
       } else {
 	(*updated)[p] = false;
@@ -819,20 +1170,53 @@ void UpdateSingleStump(const vector<Patch>& patches, const Classifier& c,
     }
 
     if ((*updated)[p]) {
-      float response = c.chains_[i].stumps_[j].Evaluate(patches[p]);
-      (*activations)[p] += c.chains_[i].weights_[j] * response;
+      float response = stump.Evaluate(responses[p]);
+      (*activations)[p] += weight * response;
+      if (changes && (*changes)[p] == 0) {
+        (*changes)[p] = (weight * response > 0) ? 1 : -1;
+      }
+    }
+  }
+}
+
+void UpdateSingleStump(const vector<Patch>& patches, const Classifier& c,
+                       int i, int j, vector<float>* activations, vector<bool>* updated,
+                       vector<char>* changes) {
+  const Feature& feature = c.chains_[i].stumps_[j].base_;
+
+  vector<float> responses(patches.size(), 0.0);
+  for (unsigned int p = 0; p < patches.size(); p++) {
+    if (!c.filters_are_permanent_ || (*updated)[p]) {
+      responses[p] = feature.Evaluate(patches[p]);
     }
   }
+
+  ApplySingleStump(c, i, j, responses, activations, updated, changes);
+}
+
+void UpdateSingleStump(const PatchBatch& patches, const Classifier& c,
+                       int i, int j, vector<float>* activations, vector<bool>* updated,
+                       vector<char>* changes) {
+  const Feature& feature = c.chains_[i].stumps_[j].base_;
+
+  // Evaluating every patch vectorizes, which is cheaper than skipping
+  // the ones that have been filtered out.
+  vector<float> responses(patches.size(), 0.0);
+  if (!patches.empty()) {
+    feature.Evaluate(patches, 0, patches.size(), &responses[0]);
+  }
+
+  ApplySingleStump(c, i, j, responses, activations, updated, changes);
 }
 
-void OutputROC(string filename, const vector<Patch>& patches,
+void OutputROC(string filename, const vector<char>& labels,
                const vector<float>& activations) {
   ofstream roc_file(filename.c_str(), ofstream::out);
 
-  vector< pair<float, char> > sortable(patches.size());
-  for (int p = 0; p < (int)(patches.size()); p++) {
+  vector< pair<float, char> > sortable(labels.size());
+  for (int p = 0; p < (int)(labels.size()); p++) {
     sortable[p].first = activations[p];
-    sortable[p].second = patches[p].label();
+    sortable[p].second = labels[p];
   }
 
   sort(sortable.begin(), sortable.end());
@@ -840,7 +1224,7 @@ void OutputROC(string filename, const vector<Patch>& patches,
   int positives = 0;
   int negatives = 0;
 
-  for (int p = 0; p < (int)(patches.size() - 1); p++) {
+  for (int p = 0; p < (int)(labels.size() - 1); p++) {
     if (sortable[p].second > 0) {
       positives++;
     } else {
@@ -852,7 +1236,7 @@ void OutputROC(string filename, const vector<Patch>& patches,
   float false_positives = 0;
 
   roc_file << "0,0" << endl;
-  for (int p = (int)(patches.size() - 1); p >= 0; p--) {
+  for (int p = (int)(labels.size() - 1); p >= 0; p--) {
     if (sortable[p].second > 0) {
       true_positives++;
     } else {
@@ -869,7 +1253,7 @@ void OutputROC(string filename, const vector<Patch>& patches,
   roc_file.close();
 }
 
-void GenerateStatistics(string filename, const vector<Patch>& patches,
+void GenerateStatistics(string filename, const PatchBatch& patches,
 			const Classifier& c, string roc_filename,
                         int roc_iteration) {
   vector<float> activations(patches.size(), 0.0);
@@ -877,12 +1261,14 @@ void GenerateStatistics(string filename, const vector<Patch>& patches,
 
   ofstream stats_file(filename.c_str(), ofstream::out);
 
-  float exp_loss, zero_one_loss;
-  float positive_loss, negative_loss;
+  LossStatistics stats;
+  ComputeLosses(patches.labels(), vector<float>(), activations, &stats);
+
+  float exp_loss = stats.exp_loss;
+  float zero_one_loss = stats.zero_one_loss;
+  float positive_loss = stats.positive_loss;
+  float negative_loss = stats.negative_loss;
   float average_features = 0.0;
-  exp_loss = ExpLoss(patches, activations);
-  zero_one_loss = ZeroOneLoss(patches, activations,
-                              &positive_loss, &negative_loss);
   cout << "Initial" << endl;
   cout << "exp loss: " << exp_loss
        << ", 0/1 loss: " << zero_one_loss << endl;
@@ -909,9 +1295,11 @@ void GenerateStatistics(string filename, const vector<Patch>& patches,
 
       cout << "alpha: " << c.chains_[i].weights_[j] << endl;
 
-      exp_loss = ExpLoss(patches, activations);
-      zero_one_loss = ZeroOneLoss(patches, activations,
-				  &positive_loss, &negative_loss);
+      ComputeLosses(patches.labels(), vector<float>(), activations, &stats);
+      exp_loss = stats.exp_loss;
+      zero_one_loss = stats.zero_one_loss;
+      positive_loss = stats.positive_loss;
+      negative_loss = stats.negative_loss;
       cout << "exp loss: " << exp_loss
 	   << ", 0/1 loss: " << zero_one_loss << endl;
       cout << "+ err: " << positive_loss << ", - err: " << negative_loss << endl;
@@ -931,7 +1319,7 @@ void GenerateStatistics(string filename, const vector<Patch>& patches,
     }
 
     if ((roc_filename != "") && (i == roc_iteration)) {
-      OutputROC(roc_filename, patches, activations);
+      OutputROC(roc_filename, patches.labels(), activations);
     }
 
     
@@ -944,4 +1332,13 @@ void GenerateStatistics(string filename, const vector<Patch>& patches,
   stats_file.close();
 }
 
+void GenerateStatistics(string filename, const vector<Patch>& patches,
+			const Classifier& c, string roc_filename,
+                        int roc_iteration) {
+  PatchBatch batch(PatchBatch::kPixelMajor);
+  batch.Append(patches);
+
+  GenerateStatistics(filename, batch, c, roc_filename, roc_iteration);
+}
+
 }  // namespace speedboost
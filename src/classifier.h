@@ -8,6 +8,7 @@
 #define SPEEDBOOST_CLASSIFIER_H
 
 #include <stdio.h>
+#include <unordered_map>
 
 #include "classifier.pb.h"
 #include "data_source.h"
@@ -48,6 +49,7 @@ public:
    * output by a Feature object for some patch.
    */
   float Evaluate(const Patch& p) const;
+  float Evaluate(const PatchBatch& patches, int i) const;
   float Evaluate(float response) const;
 
   /**
@@ -153,6 +155,22 @@ public:
   std::vector<float> biases_;
 };
 
+/**
+ * How far Classifier::ResumeActivation has evaluated a patch: the
+ * activation after the first stump stumps of chain chain, or, if stump
+ * is 0, the activation before chain's filter is checked.  stopped is
+ * set once a permanent filter has rejected the patch.
+ */
+struct ActivationState {
+  ActivationState()
+    : activation(0.0), chain(0), stump(0), stopped(false) {}
+
+  float activation;
+  int chain;
+  int stump;
+  bool stopped;
+};
+
 /**
  * Classifier object.
  * Store a sequence of chains (see above),
@@ -209,6 +227,16 @@ public:
    */
   float Activation(const Patch &p) const;
 
+  /**
+   * Return the activation for patch p, continuing from state, the
+   * result of an earlier call on p, and only evaluating the stumps
+   * added since.  This assumes the classifier has only grown since
+   * then: chains and stumps are appended, but existing ones (and the
+   * filters of chains that already have stumps) aren't changed, as in
+   * TrainBoosted and TrainCascade.  state is updated for the next call.
+   */
+  float ResumeActivation(const Patch& p, ActivationState* state) const;
+
   ClassifierType type_;
 
   std::vector<Chain> chains_;
@@ -231,13 +259,89 @@ public:
   bool filters_are_permanent_;
 };
 
+/**
+ * Activations of patches under a growing classifier, keyed by the
+ * record they were read from (see Patch::id), so scoring a patch again
+ * after more stumps are trained only evaluates the new stumps.  Patches
+ * without an id are always evaluated in full.  Once max_size records
+ * are cached, new records are evaluated in full without being added.
+ */
+class ActivationCache {
+public:
+  explicit ActivationCache(size_t max_size);
+
+  float Activation(const Patch& p, const Classifier& c);
+
+  void Clear();
+
+  inline size_t size() const { return states_.size(); }
+  // Number of lookups that found a cached record since the last Clear.
+  inline size_t hits() const { return hits_; }
+
+private:
+  // Cached states are only valid for the classifier they came from.
+  const Classifier* classifier_;
+  size_t max_size_;
+  std::unordered_map<int64_t, ActivationState> states_;
+  size_t hits_;
+};
+
+/**
+ * Exp and 0/1 losses of the activations for patches, optionally
+ * weighted by sample_weights (if they are the same size as activations).
+ * ZeroOneLoss also returns the loss on just the positives and negatives.
+ */
+float ExpLoss(const std::vector<Patch>& patches, const std::vector<float>& activations);
+float ExpLoss(const std::vector<Patch>& patches, const std::vector<float>& sample_weights,
+              const std::vector<float>& activations);
+float ZeroOneLoss(const std::vector<Patch>& patches, const std::vector<float> activations,
+                  float* positive_loss, float* negative_loss);
+float ZeroOneLoss(const std::vector<Patch>& patches, const std::vector<float>& sample_weights,
+                  const std::vector<float> activations,
+                  float* positive_loss, float* negative_loss);
+
+/**
+ * Boosting weights exp(-y f(x)) for the activations f(x),
+ * optionally scaled by sample_weights.
+ */
+void Gradient(const std::vector<Patch>& patches, const std::vector<float>& sample_weights,
+              const std::vector<float> activations, std::vector<float>* weights);
+
+/**
+ * Losses of a set of activations, as computed by ExpLoss and ZeroOneLoss.
+ * The 0/1 losses are fractions of the (sample weighted) examples, with
+ * positive_loss and negative_loss over just the positives or negatives.
+ */
+struct LossStatistics {
+  float exp_loss;
+  float zero_one_loss;
+  float positive_loss;
+  float negative_loss;
+};
+
+/**
+ * Compute the exp and 0/1 losses in a single parallel pass, using
+ * sample_weights if they are the same size as activations.
+ */
+void ComputeLosses(const std::vector<Patch>& patches, const std::vector<float>& sample_weights,
+                   const std::vector<float>& activations, LossStatistics* stats);
+void ComputeLosses(const std::vector<char>& labels, const std::vector<float>& sample_weights,
+                   const std::vector<float>& activations, LossStatistics* stats);
+
 /**
  * Update activations using stump j from chain i in classifier c.
  * Which patches are / have been updated are tracked in the updated vector.
  * Both activations and updated should be the same size as patches.
+ * If given, changes records how each activation changed: 0 if it was not
+ * updated, 1 or -1 if the stump's weight was added or subtracted, and 2
+ * if it was reset by the chain's filter first.
  */
 void UpdateSingleStump(const std::vector<Patch>& patches, const Classifier& c,
-                       int i, int j, std::vector<float>* activations, std::vector<bool>* updated);
+                       int i, int j, std::vector<float>* activations, std::vector<bool>* updated,
+                       std::vector<char>* changes = NULL);
+void UpdateSingleStump(const PatchBatch& patches, const Classifier& c,
+                       int i, int j, std::vector<float>* activations, std::vector<bool>* updated,
+                       std::vector<char>* changes = NULL);
 
 /**
  * Train a cascade on max_positives and max_negatives training patches
@@ -263,6 +367,9 @@ void TrainBoosted(DataSource& data, const std::vector<Feature>& features,
 void GenerateStatistics(std::string filename, const std::vector<Patch>& patches,
 			const Classifier& c, std::string roc_filename,
                         int roc_iteration);
+void GenerateStatistics(std::string filename, const PatchBatch& patches,
+			const Classifier& c, std::string roc_filename,
+                        int roc_iteration);
 
 }  // namespace speedboost
 
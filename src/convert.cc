@@ -0,0 +1,116 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <cmath>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "patch.h"
+#include "patch_file.h"
+#include "util.h"
+
+using namespace speedboost;
+using namespace std;
+
+DEFINE_string(input_glob, "",
+              "Protobuf patch files (as written by load) to convert.");
+DEFINE_string(output_filename, "",
+              "Patch file to write.");
+DEFINE_int32(label, -1,
+             "If non-negative, every input patch must have this label and it is "
+             "stored once in the header.  Otherwise each record stores its own label.");
+DEFINE_bool(store_integral, false,
+            "If true, store integral images instead of pixels, so they are "
+            "read ready to use.  Takes 4 bytes per pixel instead of 1.");
+
+int main(int argc, char *argv[])
+{
+  string usage = "Convert protobuf patch files to a single memory-mappable patch file.  Usage:\n";
+  usage += argv[0];
+  usage += " [options]";
+  google::SetUsageMessage(usage);
+
+  // parse up the flags
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if ("" == FLAGS_input_glob) {
+    cout << "Input glob is empty, exiting." << endl;
+    google::ShowUsageWithFlags(argv[0]);
+    return 1;
+  }
+
+  if ("" == FLAGS_output_filename) {
+    cout << "Output filename is empty, exiting." << endl;
+    google::ShowUsageWithFlags(argv[0]);
+    return 1;
+  }
+
+  vector<string> filenames;
+  ExpandFileGlob(FLAGS_input_glob, &filenames);
+  if (filenames.empty()) {
+    cout << "No files match " << FLAGS_input_glob << ", exiting." << endl;
+    return 1;
+  }
+
+  PatchFile::LabelLayout layout = (FLAGS_label >= 0) ? PatchFile::kFileLabel : PatchFile::kRecordLabels;
+  PatchFileWriter writer;
+  bool opened = false;
+  float max_error = 0.0;
+
+  for (unsigned int f = 0; f < filenames.size(); f++) {
+    ifstream in(filenames[f].c_str(), ifstream::in | ifstream::binary);
+
+    Patch p;
+    while (p.Read(in)) {
+      if (p.is_integral()) {
+        cout << filenames[f] << " holds integral images, convert needs the original pixels." << endl;
+        return 1;
+      }
+
+      if (!opened) {
+        if (!writer.Open(FLAGS_output_filename, p.width(), p.height(), p.channels(),
+                         layout, max(FLAGS_label, 0), FLAGS_store_integral)) {
+          return 1;
+        }
+        opened = true;
+      }
+
+      if (!writer.Write(p)) {
+        cout << "Failed to convert patch from " << filenames[f] << endl;
+        return 1;
+      }
+
+      // Keep track of how much is lost by going to 8 bits.
+      for (int c = 0; c < p.channels(); c++) {
+        for (int h = 0; h < p.height(); h++) {
+          for (int w = 0; w < p.width(); w++) {
+            float v = p.Value(w, h, c);
+            max_error = max(max_error, fabs(v - floor(v * 255.0f + 0.5f) / 255.0f));
+          }
+        }
+      }
+    }
+    in.close();
+  }
+
+  if (!opened) {
+    cout << "No patches found in " << FLAGS_input_glob << endl;
+    return 1;
+  }
+
+  size_t count = writer.count();
+  if (!writer.Close()) {
+    cout << "Failed to write " << FLAGS_output_filename << endl;
+    return 1;
+  }
+
+  cout << "Converted " << count << " patches from " << filenames.size() << " files to "
+       << FLAGS_output_filename << ", max quantization error " << max_error << endl;
+  return 0;
+}
@@ -6,16 +6,24 @@
 
 #include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cmath>
 #include <gflags/gflags.h>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "classifier.h"
 #include "data_source.h"
+#include "detector.h"
+#include "frame_set.h"
+#include "patch_dataset.h"
+#include "patch_reader.h"
+#include "resampling_pool.h"
+#include "shuffle_buffer.h"
 #include "util.h"
 
 using namespace std;
@@ -28,22 +36,124 @@ DEFINE_int32(num_positives_to_sample, 10000,
              "e.g. the number of positives in the data set.");
 DEFINE_int32(max_read_attempts, 10,
 	     "Max number of attempts at reading (and extracting) a patch before failing.");
+DEFINE_int32(reader_threads, 0,
+             "Number of threads reading, decoding and integrating patches from "
+             "several files at once, for each label.  0 reads one file at a time "
+             "in the calling thread, keeping patches in file order.");
+DEFINE_int32(reader_queue_size, 1024,
+             "Number of patches each set of reader threads can buffer ahead.");
+DEFINE_int32(shuffle_buffer_size, 0,
+             "Number of streamed patches (per label) to hold in a buffer that "
+             "reads are drawn from at random, each replaced by the next patch "
+             "of one of --shuffle_shards files read at once.  Breaks up the "
+             "order of the files while still reading them sequentially.  "
+             "0 reads the patches in file order.");
+DEFINE_int32(shuffle_shards, 8,
+             "Number of files the shuffle buffer interleaves at once.");
+DEFINE_bool(random_access, false,
+            "Index every record of the data files when opening them, and draw "
+            "uniformly random patches (with replacement) instead of streaming "
+            "through the files in order.  Sampled loading then resamples an "
+            "i.i.d. stream by weight, and the data set sizes are taken from the "
+            "index.");
+DEFINE_bool(activation_cache, false,
+            "Cache the classifier activation of every patch drawn while "
+            "resampling, keyed by its record, so drawing it again only "
+            "evaluates the stumps added since.  Patches from unmapped files "
+            "aren't cached.");
+DEFINE_int32(activation_cache_size, 10000000,
+             "Max number of records in the activation cache.");
+DEFINE_int32(resample_pool_size, 0,
+             "Number of patches to keep in memory for sampled loading, which "
+             "then resamples this pool (scored in parallel) every stage instead "
+             "of the data stream.  It is split into a positive and a negative "
+             "pool in proportion to num_positives_to_sample and "
+             "num_negatives_to_sample.  0 samples from the stream.");
+DEFINE_double(resample_pool_refresh, 0.0,
+              "Fraction of the resampling pool replaced with newly read patches "
+              "before each sample after the first.");
+DEFINE_double(frames_initial_scale, 1.0,
+              "In frames mode, the scale of the first level of each frame's "
+              "pyramid, which is the frame scaled by 1 / frames_initial_scale.");
+DEFINE_int32(frames_num_scales, 8,
+             "In frames mode, number of levels in each frame's pyramid.");
+DEFINE_double(frames_scaling_factor, 1.2,
+              "In frames mode, factor each level of the pyramid scales down by.");
+DEFINE_double(frames_max_negative_overlap, 0.2,
+              "In frames mode, windows with an intersection over union above "
+              "this with any label aren't used as negatives.");
+DEFINE_string(mining_frames_glob, "",
+              "Frames (whole images with no positives in them) to mine cascade "
+              "negatives from.  If given, the negatives for each cascade stage "
+              "are the windows the cascade so far still accepts, found by running "
+              "the detector over these frames (at the --frames_* scales).  Files "
+              "are frames with labels, as written by load --extract_patches=false "
+              "(see WriteLabeledPatchesToFile), and frames with any labels are skipped.");
+DEFINE_int32(mining_windows_per_frame, 100,
+             "Max number of hard negatives mined from any one frame.");
+DEFINE_bool(prefetch_patches, false,
+            "Read, decode and integrate patches in background threads, "
+            "so loading the next stage's data overlaps with training.");
+DEFINE_int32(prefetch_buffer_size, 10000,
+             "Number of positive (and negative) patches read ahead at a time "
+             "by the prefetch threads.");
 
 namespace speedboost {
 
+// Patch ids for records of mapped files are made by PatchStream::RecordId.
+// Records drawn from a PatchDataset use their index in it, with the top
+// bits marking the data set.
+static const int64_t kDatasetRecord = (int64_t)1 << 62;
+static const int64_t kNegativeDatasetRecord = (int64_t)1 << 61;
+// Frames mode positives use their index, and windows their number.
+static const int64_t kFrameWindowRecord = (int64_t)1 << 60;
+
 DataSource::DataSource(const string& positive_file_glob, const string& negative_file_glob)
   : frames_mode_(false),
     positive_filenames_(),
     negative_filenames_(),
-    positive_file_(),
-    negative_file_(),
-    positive_filenames_index_(0),
-    negative_filenames_index_(0),
+    file_numbers_(),
+    positive_files_(),
+    negative_files_(),
+    positive_stream_(),
+    negative_stream_(),
     num_positives_to_sample_(FLAGS_num_positives_to_sample),
-    num_negatives_to_sample_(FLAGS_num_negatives_to_sample) {
+    num_negatives_to_sample_(FLAGS_num_negatives_to_sample),
+    positive_reader_(NULL),
+    negative_reader_(NULL),
+    positive_shuffle_(NULL),
+    negative_shuffle_(NULL),
+    positive_dataset_(NULL),
+    negative_dataset_(NULL),
+    activation_cache_(NULL),
+    positive_pool_(NULL),
+    negative_pool_(NULL),
+    frames_(NULL),
+    frame_positive_order_(),
+    frame_positive_index_(0),
+    mining_filenames_(),
+    mining_filenames_index_(0),
+    prefetching_(false),
+    prefetch_buffer_size_(0) {
   ExpandFileGlob(positive_file_glob, &positive_filenames_);
   ExpandFileGlob(negative_file_glob, &negative_filenames_);
 
+  for (unsigned int f = 0; f < positive_filenames_.size(); f++) {
+    file_numbers_.insert(make_pair(positive_filenames_[f], (int)file_numbers_.size()));
+  }
+  for (unsigned int f = 0; f < negative_filenames_.size(); f++) {
+    file_numbers_.insert(make_pair(negative_filenames_[f], (int)file_numbers_.size()));
+  }
+
+  if (FLAGS_activation_cache) {
+    activation_cache_ = new ActivationCache(FLAGS_activation_cache_size);
+  }
+
+  if (FLAGS_mining_frames_glob != "") {
+    ExpandFileGlob(FLAGS_mining_frames_glob, &mining_filenames_);
+    random_shuffle(mining_filenames_.begin(), mining_filenames_.end());
+  }
+
   // Permute the filenames for the first time.
   random_shuffle(positive_filenames_.begin(), positive_filenames_.end());
   random_shuffle(negative_filenames_.begin(), negative_filenames_.end());
@@ -51,100 +161,412 @@ DataSource::DataSource(const string& positive_file_glob, const string& negative_
   assert(positive_filenames_.size() > 0);
   assert(negative_filenames_.size() > 0);
 
+  positive_files_ = FileCycle(positive_filenames_, file_numbers_);
+  negative_files_ = FileCycle(negative_filenames_, file_numbers_);
+
+  if (FLAGS_random_access) {
+    positive_dataset_ = OpenDataset(positive_filenames_);
+    negative_dataset_ = OpenDataset(negative_filenames_);
+
+    // The index gives the exact data set size to sample from.
+    if (positive_dataset_ && google::GetCommandLineFlagInfoOrDie("num_positives_to_sample").is_default) {
+      num_positives_to_sample_ = positive_dataset_->size();
+    }
+    if (negative_dataset_ && google::GetCommandLineFlagInfoOrDie("num_negatives_to_sample").is_default) {
+      num_negatives_to_sample_ = negative_dataset_->size();
+    }
+  }
+
   assert(CheckDataAgainstFlags(true));
   assert(CheckDataAgainstFlags(false));
+
+  CreateResamplingPools();
+
+  if (FLAGS_reader_threads > 0 && !FLAGS_random_access) {
+    positive_reader_ = new PatchReader(positive_filenames_, file_numbers_,
+                                       FLAGS_reader_threads, FLAGS_reader_queue_size);
+    negative_reader_ = new PatchReader(negative_filenames_, file_numbers_,
+                                       FLAGS_reader_threads, FLAGS_reader_queue_size);
+  }
+
+  if (FLAGS_shuffle_buffer_size > 0) {
+    if (positive_reader_) {
+      cout << "WARNING: --shuffle_buffer_size is ignored with --reader_threads." << endl;
+    } else {
+      // Random access draws are already shuffled.
+      if (!positive_dataset_) {
+        positive_shuffle_ = new ShuffleBuffer(positive_filenames_, file_numbers_,
+                                              FLAGS_shuffle_shards, FLAGS_shuffle_buffer_size);
+      }
+      if (!negative_dataset_) {
+        negative_shuffle_ = new ShuffleBuffer(negative_filenames_, file_numbers_,
+                                              FLAGS_shuffle_shards, FLAGS_shuffle_buffer_size);
+      }
+    }
+  }
+
+  if (FLAGS_prefetch_patches) {
+    StartPrefetch(FLAGS_prefetch_buffer_size);
+  }
 }
 
 DataSource::DataSource(const string& frames_file_glob)
   : frames_mode_(true),
     positive_filenames_(),
     negative_filenames_(),
-    positive_file_(),
-    negative_file_(),
-    positive_filenames_index_(0),
-    negative_filenames_index_(0),
+    file_numbers_(),
+    positive_files_(),
+    negative_files_(),
+    positive_stream_(),
+    negative_stream_(),
     num_positives_to_sample_(FLAGS_num_positives_to_sample),
-    num_negatives_to_sample_(FLAGS_num_negatives_to_sample) {
+    num_negatives_to_sample_(FLAGS_num_negatives_to_sample),
+    positive_reader_(NULL),
+    negative_reader_(NULL),
+    positive_shuffle_(NULL),
+    negative_shuffle_(NULL),
+    positive_dataset_(NULL),
+    negative_dataset_(NULL),
+    activation_cache_(NULL),
+    positive_pool_(NULL),
+    negative_pool_(NULL),
+    frames_(NULL),
+    frame_positive_order_(),
+    frame_positive_index_(0),
+    mining_filenames_(),
+    mining_filenames_index_(0),
+    prefetching_(false),
+    prefetch_buffer_size_(0) {
   ExpandFileGlob(frames_file_glob, &positive_filenames_);
 
   // Permute the filenames for the first time.
   random_shuffle(positive_filenames_.begin(), positive_filenames_.end());
 
   assert(positive_filenames_.size() > 0);
+
+  frames_ = new FrameSet();
+  frames_->Load(positive_filenames_, FLAGS_frames_initial_scale, FLAGS_frames_num_scales,
+                FLAGS_frames_scaling_factor, FLAGS_frames_max_negative_overlap);
+
+  frame_positive_order_.resize(frames_->positives().size());
+  for (unsigned int i = 0; i < frame_positive_order_.size(); i++) {
+    frame_positive_order_[i] = i;
+  }
+  random_shuffle(frame_positive_order_.begin(), frame_positive_order_.end());
+
+  // Sample from all of the labels and windows unless told otherwise.
+  if (google::GetCommandLineFlagInfoOrDie("num_positives_to_sample").is_default) {
+    num_positives_to_sample_ = frames_->positives().size();
+  }
+  if (google::GetCommandLineFlagInfoOrDie("num_negatives_to_sample").is_default) {
+    num_negatives_to_sample_ = min(frames_->num_windows(), (int64_t)INT_MAX);
+  }
+
+  if (FLAGS_activation_cache) {
+    activation_cache_ = new ActivationCache(FLAGS_activation_cache_size);
+  }
+
+  CreateResamplingPools();
+
+  if (FLAGS_prefetch_patches) {
+    StartPrefetch(FLAGS_prefetch_buffer_size);
+  }
 }
 
-int DataSource::GetPositivePatches(int max_num_patches, vector<Patch>* patches) {
-  int num_read = 0;
-  while (num_read < max_num_patches) {
-    Patch p;
-    if (!ReadPositivePatch(&p)) {
-      return num_read;
+DataSource::~DataSource() {
+  StopPrefetch();
+
+  delete positive_reader_;
+  delete negative_reader_;
+  delete positive_shuffle_;
+  delete negative_shuffle_;
+  delete positive_dataset_;
+  delete negative_dataset_;
+  delete activation_cache_;
+  delete positive_pool_;
+  delete negative_pool_;
+  delete frames_;
+}
+
+void DataSource::CreateResamplingPools() {
+  if (FLAGS_resample_pool_size <= 0)
+    return;
+
+  double total = (double)num_positives_to_sample_ + (double)num_negatives_to_sample_;
+  int num_positive = (int)(FLAGS_resample_pool_size * num_positives_to_sample_ / total + 0.5);
+  positive_pool_ = new ResamplingPool(this, true, num_positive, FLAGS_resample_pool_refresh);
+  negative_pool_ = new ResamplingPool(this, false, FLAGS_resample_pool_size - num_positive,
+                                      FLAGS_resample_pool_refresh);
+}
+
+void DataSource::StartPrefetch(int buffer_size) {
+  if (prefetching_ || buffer_size <= 0)
+    return;
+
+  prefetching_ = true;
+  prefetch_buffer_size_ = buffer_size;
+
+  PrefetchBuffer* buffers[2] = {&positive_prefetch_, &negative_prefetch_};
+  for (int b = 0; b < 2; b++) {
+    buffers[b]->ready.clear();
+    buffers[b]->filling.clear();
+    buffers[b]->next = 0;
+    buffers[b]->full = false;
+    buffers[b]->finished = false;
+    buffers[b]->stop = false;
+  }
+
+  positive_prefetch_.thread = thread(&DataSource::PrefetchThread, this, true);
+  negative_prefetch_.thread = thread(&DataSource::PrefetchThread, this, false);
+}
+
+void DataSource::StopPrefetch() {
+  if (!prefetching_)
+    return;
+
+  PrefetchBuffer* buffers[2] = {&positive_prefetch_, &negative_prefetch_};
+  for (int b = 0; b < 2; b++) {
+    {
+      lock_guard<mutex> lock(buffers[b]->lock);
+      buffers[b]->stop = true;
     }
-    
-    patches->push_back(p);
-    num_read++;
+    buffers[b]->changed.notify_all();
   }
 
-  return num_read;
+  for (int b = 0; b < 2; b++) {
+    buffers[b]->thread.join();
+    buffers[b]->ready.clear();
+    buffers[b]->filling.clear();
+    buffers[b]->next = 0;
+  }
+
+  prefetching_ = false;
 }
 
-int DataSource::GetNegativePatches(int max_num_patches, vector<Patch>* patches) {
-  int num_read = 0;
-  while (num_read < max_num_patches) {
-    Patch p;
-    if (!ReadNegativePatch(&p)) {
-      return num_read;
+void DataSource::PrefetchThread(bool positive) {
+  PrefetchBuffer* buffer = positive ? &positive_prefetch_ : &negative_prefetch_;
+
+  bool failed = false;
+  while (!failed) {
+    // Fill a whole buffer without holding the lock, then wait for the
+    // reader to finish with the previous one before handing it over.
+    vector<Patch> patches;
+    patches.reserve(prefetch_buffer_size_);
+    for (int i = 0; i < prefetch_buffer_size_ && !buffer->stop; i++) {
+      Patch p;
+      if (!ReadPatchFromFile(positive, &p)) {
+        failed = true;
+        break;
+      }
+      patches.push_back(std::move(p));
     }
-    
-    patches->push_back(p);
-    num_read++;
+
+    unique_lock<mutex> lock(buffer->lock);
+    while (buffer->full && !buffer->stop) {
+      buffer->changed.wait(lock);
+    }
+    if (buffer->stop)
+      break;
+
+    buffer->filling.swap(patches);
+    buffer->full = true;
+    buffer->changed.notify_all();
   }
 
-  return num_read;
+  lock_guard<mutex> lock(buffer->lock);
+  buffer->finished = true;
+  buffer->changed.notify_all();
+}
+
+bool DataSource::ReadPrefetchedPatch(bool positive, Patch* p) {
+  PrefetchBuffer* buffer = positive ? &positive_prefetch_ : &negative_prefetch_;
+
+  if (buffer->next == buffer->ready.size()) {
+    unique_lock<mutex> lock(buffer->lock);
+    while (!buffer->full && !buffer->finished) {
+      buffer->changed.wait(lock);
+    }
+    if (!buffer->full)
+      return false;
+
+    // Swap in the buffer the thread just filled, and let it start on
+    // the next one.
+    buffer->ready.swap(buffer->filling);
+    buffer->filling.clear();
+    buffer->next = 0;
+    buffer->full = false;
+    buffer->changed.notify_all();
+
+    if (buffer->ready.empty())
+      return false;
+  }
+
+  *p = std::move(buffer->ready[buffer->next++]);
+  return true;
+}
+
+int DataSource::GetPositivePatches(int max_num_patches, vector<Patch>* patches) {
+  return GetPatches(true, max_num_patches, NULL, patches, NULL);
+}
+
+int DataSource::GetNegativePatches(int max_num_patches, vector<Patch>* patches) {
+  return GetPatches(false, max_num_patches, NULL, patches, NULL);
+}
+
+int DataSource::GetPositivePatches(int max_num_patches, PatchBatch* patches) {
+  return GetPatches(true, max_num_patches, NULL, NULL, patches);
+}
+
+int DataSource::GetNegativePatches(int max_num_patches, PatchBatch* patches) {
+  return GetPatches(false, max_num_patches, NULL, NULL, patches);
 }
 
 int DataSource::GetPositivePatchesActive(int max_num_patches, const Classifier& c, vector<Patch>* patches) {
+  return GetPatches(true, max_num_patches, &c, patches, NULL);
+}
+
+int DataSource::GetNegativePatchesActive(int max_num_patches, const Classifier& c, vector<Patch>* patches) {
+  return GetPatches(false, max_num_patches, &c, patches, NULL);
+}
+
+int DataSource::GetPositivePatchesActive(int max_num_patches, const Classifier& c, PatchBatch* patches) {
+  return GetPatches(true, max_num_patches, &c, NULL, patches);
+}
+
+int DataSource::GetNegativePatchesActive(int max_num_patches, const Classifier& c, PatchBatch* patches) {
+  return GetPatches(false, max_num_patches, &c, NULL, patches);
+}
+
+void DataSource::AddPatch(Patch* p, vector<Patch>* patches, PatchBatch* batch) {
+  if (batch) {
+    batch->Append(*p);
+  } else {
+    // The caller reads the next patch into p from scratch, so its
+    // pixels can be handed over instead of copied.
+    patches->push_back(std::move(*p));
+  }
+}
+
+int DataSource::GetPatches(bool positive, int max_num_patches, const Classifier* c,
+                           vector<Patch>* patches, PatchBatch* batch) {
+  if (!positive && c && !mining_filenames_.empty()) {
+    if (c->type_ == Classifier::kCascade && !c->chains_.empty() && c->chains_.back().stumps_.empty()) {
+      return MineNegatives(max_num_patches, *c, patches, batch);
+    }
+    cout << "WARNING: can only mine negatives for a cascade's next stage, reading them instead." << endl;
+  }
+
   int num_read = 0;
   int num_added = 0;
+
+  if (batch) {
+    batch->Reserve(batch->size() + max_num_patches);
+  } else {
+    patches->reserve(patches->size() + max_num_patches);
+  }
+
+  Patch p;
   while (num_added < max_num_patches) {
-    Patch p;
-    if (!ReadPositivePatch(&p)) {
+    if (!(positive ? ReadPositivePatch(&p) : ReadNegativePatch(&p))) {
       return num_added;
     }
 
-    if (c.IsActiveInLastChain(p)) {
-      patches->push_back(p);
+    if (!c || c->IsActiveInLastChain(p)) {
+      AddPatch(&p, patches, batch);
       num_added++;
     }
     num_read++;
   }
 
-  cout << "Loaded " << num_added << " patches, read " << num_read << endl;
+  if (c) {
+    cout << "Loaded " << num_added << " patches, read " << num_read << endl;
+  }
   return num_added;
 }
 
-int DataSource::GetNegativePatchesActive(int max_num_patches, const Classifier& c, vector<Patch>* patches) {
-  int num_read = 0;
+int DataSource::MineNegatives(int max_num_patches, const Classifier& c,
+                              vector<Patch>* patches, PatchBatch* batch) {
   int num_added = 0;
-  while (num_added < max_num_patches) {
-    Patch p;
-    if (!ReadNegativePatch(&p)) {
-      return num_added;
+  int num_frames = 0;
+  int files_without_windows = 0;
+
+  if (batch) {
+    batch->Reserve(batch->size() + max_num_patches);
+  } else {
+    patches->reserve(patches->size() + max_num_patches);
+  }
+
+  Detector detector(&c, FLAGS_frames_initial_scale, FLAGS_frames_num_scales,
+                    FLAGS_frames_scaling_factor, 0.0);
+
+  while (num_added < max_num_patches &&
+         files_without_windows < (int)(mining_filenames_.size())) {
+    if (mining_filenames_index_ >= (int)(mining_filenames_.size())) {
+      mining_filenames_index_ = 0;
+      random_shuffle(mining_filenames_.begin(), mining_filenames_.end());
     }
 
-    if (c.IsActiveInLastChain(p)) {
-      patches->push_back(p);
-      num_added++;
+    const string& filename = mining_filenames_[mining_filenames_index_++];
+    vector<Patch> labeled_frames;
+    vector< vector<Label> > labels;
+    ReadLabeledPatchesFromFile(filename, INT_MAX, &labeled_frames, &labels);
+
+    // Any window of a frame with positives in it could be one of them.
+    vector<Patch> frames;
+    int num_skipped = 0;
+    for (unsigned int f = 0; f < labeled_frames.size(); f++) {
+      if (labels[f].empty()) {
+        frames.push_back(std::move(labeled_frames[f]));
+      } else {
+        num_skipped++;
+      }
     }
-    num_read++;
+    if (num_skipped > 0) {
+      cout << "WARNING: skipping " << num_skipped << " frames with labels in " << filename
+           << ", mining frames must have no positives." << endl;
+    }
+    random_shuffle(frames.begin(), frames.end());
+
+    // Frames are independent, so run the detector on several at once,
+    // skipping the rest once enough windows are found.
+    int num_found = 0;
+    unsigned int file_seed = rand();
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int f = 0; f < (int)(frames.size()); f++) {
+      bool done;
+      #pragma omp critical(mine_negatives)
+      done = (num_added >= max_num_patches);
+      if (done)
+        continue;
+
+      unsigned int seed = file_seed + f;
+      vector<Patch> windows;
+      detector.ComputeActiveWindows(frames[f], FLAGS_mining_windows_per_frame, &seed, &windows);
+
+      #pragma omp critical(mine_negatives)
+      {
+        num_frames++;
+        num_found += windows.size();
+        for (unsigned int w = 0; w < windows.size() && num_added < max_num_patches; w++) {
+          AddPatch(&windows[w], patches, batch);
+          num_added++;
+        }
+      }
+    }
+
+    files_without_windows = (num_found > 0) ? 0 : files_without_windows + 1;
   }
 
-  cout << "Loaded " << num_added << " patches, read " << num_read << endl;
+  cout << "Mined " << num_added << " negatives from " << num_frames << " frames." << endl;
   return num_added;
 }
 
 int DataSource::GetPositivePatchesSampled(int max_num_patches, const Classifier& c,
                                           vector<float>* weights, vector<Patch>* patches) {
+  if (positive_pool_) {
+    return positive_pool_->Sample(max_num_patches, c, weights, patches, NULL);
+  }
+
   // Compute normalizer assuming average data set weight.
   float average_weight = ComputeAverageWeight(1.0, 500, c);
   float normalizer = average_weight * (float)num_positives_to_sample_ / (float)max_num_patches;
@@ -155,6 +577,10 @@ int DataSource::GetPositivePatchesSampled(int max_num_patches, const Classifier&
 
 int DataSource::GetNegativePatchesSampled(int max_num_patches, const Classifier& c,
                                           vector<float>* weights, vector<Patch>* patches) {
+  if (negative_pool_) {
+    return negative_pool_->Sample(max_num_patches, c, weights, patches, NULL);
+  }
+
   // Compute normalizer assuming average data set weight.
   float average_weight = ComputeAverageWeight(0.0, 500, c);
   float normalizer = average_weight * (float)num_negatives_to_sample_ / (float)max_num_patches;
@@ -166,6 +592,10 @@ int DataSource::GetNegativePatchesSampled(int max_num_patches, const Classifier&
 int DataSource::GetPatchesSampled(int max_num_patches, const Classifier& c,
                                   vector<float>* weights, vector<Patch>* patches) {
   float prob = (float)num_positives_to_sample_ / (float)(num_negatives_to_sample_ + num_positives_to_sample_);
+  if (positive_pool_) {
+    return ResamplingPool::Sample(positive_pool_, negative_pool_, max_num_patches, c,
+                                  weights, patches, NULL);
+  }
 
   // Compute normalizer assuming average data set weight.
   float average_weight = ComputeAverageWeight(prob, 500, c);
@@ -175,6 +605,22 @@ int DataSource::GetPatchesSampled(int max_num_patches, const Classifier& c,
   return GetPatchesSampled(prob, max_num_patches, normalizer, c, weights, patches);
 }
 
+int DataSource::GetPatchesSampled(int max_num_patches, const Classifier& c,
+                                  vector<float>* weights, PatchBatch* patches) {
+  float prob = (float)num_positives_to_sample_ / (float)(num_negatives_to_sample_ + num_positives_to_sample_);
+  if (positive_pool_) {
+    return ResamplingPool::Sample(positive_pool_, negative_pool_, max_num_patches, c,
+                                  weights, NULL, patches);
+  }
+
+  // Compute normalizer assuming average data set weight.
+  float average_weight = ComputeAverageWeight(prob, 500, c);
+  float normalizer = average_weight * (float)(num_negatives_to_sample_ + num_positives_to_sample_) / (float)max_num_patches;
+
+  cout << "Getting all patches. avg weight: " << average_weight << " normalizer: " << normalizer << endl;
+  return GetPatchesSampled(prob, max_num_patches, normalizer, c, weights, NULL, patches);
+}
+
 float DataSource::ComputeAverageWeight(float positive_prob, int num_patches, const Classifier& c) {
   int num_read = 0;
   float sum = 0.0;
@@ -197,7 +643,7 @@ float DataSource::ComputeAverageWeight(float positive_prob, int num_patches, con
     num_read++;
 
     float y = (p.label() > 0) ? 1.0 : -1.0;
-    float w = exp(-y * c.Activation(p));
+    float w = exp(-y * SampledActivation(p, c));
     sum += w;
   }
 
@@ -205,16 +651,22 @@ float DataSource::ComputeAverageWeight(float positive_prob, int num_patches, con
 }
 
 int DataSource::GetPatchesSampled(float positive_prob, int max_num_patches, float normalizer, const Classifier& c,
-                                  vector<float>* weights, vector<Patch>* patches) {
+                                  vector<float>* weights, vector<Patch>* patches, PatchBatch* batch) {
   int num_read_positive = 0;
   int num_read_negative = 0;
   int num_read = 0;
   int num_added = 0;
   float remainder = normalizer * (float)rand() / (float)RAND_MAX;
 
+  if (batch) {
+    batch->Reserve(batch->size() + max_num_patches);
+  } else {
+    patches->reserve(patches->size() + max_num_patches);
+  }
+  weights->reserve(weights->size() + max_num_patches);
+
+  Patch p;
   while (num_added < max_num_patches) {
-    Patch p;
-    
     // Flip coin for positive or negative.
     float sample = (float)rand() / (float)RAND_MAX;
 
@@ -232,12 +684,12 @@ int DataSource::GetPatchesSampled(float positive_prob, int max_num_patches, floa
     num_read++;
 
     float y = (p.label() > 0) ? 1.0 : -1.0;
-    float w = exp(-y * c.Activation(p));
+    float w = exp(-y * SampledActivation(p, c));
     if (w + remainder > normalizer) {
       // Number of times the low variance resampler 'hit' this sample.
       float hits = floor((w + remainder) / normalizer);
       
-      patches->push_back(p);
+      AddPatch(&p, patches, batch);
       weights->push_back(hits / w);
       remainder = fmod(w + remainder, normalizer);
 
@@ -253,65 +705,109 @@ int DataSource::GetPatchesSampled(float positive_prob, int max_num_patches, floa
   return num_added;
 }
 
-void DataSource::OpenNextFile(vector<string>* filenames, int* index, ifstream* file) {
-  if (*index >= (int)(filenames->size())) {
-    *index = 0;
-    random_shuffle(filenames->begin(), filenames->end());
-  }
+bool DataSource::ReadPatchAttempt(FileCycle* files, PatchStream* stream, Patch* p) {
+  if (stream->Read(p))
+    return true;
 
-  if (file->is_open())
-    file->close();
+  return files->OpenNext(stream) && stream->Read(p);
+}
+
+PatchDataset* DataSource::OpenDataset(const vector<string>& filenames) {
+  PatchDataset* dataset = new PatchDataset();
+  if (!dataset->Open(filenames) || dataset->size() == 0) {
+    cout << "WARNING: unable to index patches for random access, streaming them instead." << endl;
+    delete dataset;
+    return NULL;
+  }
 
-  file->open((*filenames)[*index].c_str());
-  (*index)++;
+  cout << "Indexed " << dataset->size() << " patches in " << dataset->num_files() << " files." << endl;
+  return dataset;
 }
 
 bool DataSource::ReadPositivePatchAttempt(Patch *p) {
   if (frames_mode_) {
-    cout << "Frames mode not supported yet." << endl;
-    return false;
-  } else {
-    if (!positive_file_.good()) {
-      OpenNextFile(&positive_filenames_, &positive_filenames_index_, &positive_file_);
+    if (frame_positive_order_.empty())
+      return false;
+
+    if (frame_positive_index_ >= (int)frame_positive_order_.size()) {
+      frame_positive_index_ = 0;
+      random_shuffle(frame_positive_order_.begin(), frame_positive_order_.end());
     }
+    *p = frames_->positives()[frame_positive_order_[frame_positive_index_++]];
+    return true;
+  } else if (positive_dataset_) {
+    if (!positive_dataset_->ReadRandom(p))
+      return false;
 
-    return p->Read(positive_file_);
+    p->set_id(kDatasetRecord | p->id());
+    return true;
+  } else if (positive_shuffle_) {
+    return positive_shuffle_->Read(p);
+  } else {
+    return ReadPatchAttempt(&positive_files_, &positive_stream_, p);
   }
 }
 
 bool DataSource::ReadNegativePatchAttempt(Patch *p) {
   if (frames_mode_) {
-    cout << "Frames mode not supported yet." << endl;
-    return false;
+    // Windows overlapping a label fail, and are retried by ReadPatchFromFile.
+    if (!frames_->RandomWindow(p))
+      return false;
+
+    p->set_id(kFrameWindowRecord | p->id());
+    return true;
+  } else if (negative_dataset_) {
+    if (!negative_dataset_->ReadRandom(p))
+      return false;
+
+    p->set_id(kDatasetRecord | kNegativeDatasetRecord | p->id());
+    return true;
+  } else if (negative_shuffle_) {
+    return negative_shuffle_->Read(p);
   } else {
-    if (!negative_file_.good()) {
-      OpenNextFile(&negative_filenames_, &negative_filenames_index_, &negative_file_);
-    }
-    
-    return p->Read(negative_file_);
+    return ReadPatchAttempt(&negative_files_, &negative_stream_, p);
   }
 }
 
 bool DataSource::ReadPositivePatch(Patch* p) {
-  for (int i = 0; i < FLAGS_max_read_attempts; i++) {
-    if (ReadPositivePatchAttempt(p)) {
-      p->ComputeIntegralImage();
-      return true;
-    }
+  if (prefetching_) {
+    return ReadPrefetchedPatch(true, p);
   }
-  return false;
+  return ReadPatchFromFile(true, p);
 }
 
 bool DataSource::ReadNegativePatch(Patch* p) {
+  if (prefetching_) {
+    return ReadPrefetchedPatch(false, p);
+  }
+  return ReadPatchFromFile(false, p);
+}
+
+bool DataSource::ReadPatchFromFile(bool positive, Patch* p) {
+  PatchReader* reader = positive ? positive_reader_ : negative_reader_;
+  if (reader) {
+    return reader->Read(p);
+  }
+
   for (int i = 0; i < FLAGS_max_read_attempts; i++) {
-    if (ReadNegativePatchAttempt(p)) {
-      p->ComputeIntegralImage();
+    if (positive ? ReadPositivePatchAttempt(p) : ReadNegativePatchAttempt(p)) {
+      // Files can store integral images ready to use (see load and convert).
+      if (!p->is_integral()) {
+        p->ComputeIntegralImage();
+      }
       return true;
     }
   }
   return false;
 }
 
+float DataSource::SampledActivation(const Patch& p, const Classifier& c) {
+  if (activation_cache_) {
+    return activation_cache_->Activation(p, c);
+  }
+  return c.Activation(p);
+}
+
 bool DataSource::CheckDataAgainstFlags(bool positive) {
   Patch p;
   if (positive) {
@@ -387,7 +883,7 @@ int DataSource::ReadPatchesFromFile(const string& filename, int max_num_patches,
   while (in.good() && (num_read < max_num_patches)) {
     Patch p;
     if (p.Read(in)) {
-      patches->push_back(p);
+      patches->push_back(std::move(p));
       num_read++;
     }
   }
@@ -404,7 +900,7 @@ int DataSource::ReadLabeledPatchesFromFile(const string& filename, int max_num_p
   while (in.good() && (num_read < max_num_patches)) {
     Patch p;
     if (p.Read(in)) {
-      patches->push_back(p);
+      patches->push_back(std::move(p));
       labels->push_back(vector<Label>());
 
       int num_labels = 0;
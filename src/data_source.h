@@ -7,21 +7,35 @@
 #ifndef SPEEDBOOST_DATA_SOURCE_H
 #define SPEEDBOOST_DATA_SOURCE_H
 
+#include <atomic>
+#include <condition_variable>
 #include <gflags/gflags.h>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "patch.h"
+#include "patch_batch.h"
+#include "patch_stream.h"
 
 namespace speedboost {
 
+class ActivationCache;
 class Classifier;
+class FrameSet;
+class PatchDataset;
+class PatchReader;
+class ResamplingPool;
+class ShuffleBuffer;
 
 /**
  * Object for reading and sampling training data, etc. from
  * multiple files on disk.  Data should have already been
- * converted to the binary format (see load.cc).
+ * converted to the binary format (see load.cc), or to patch
+ * files (see convert.cc).
  */
 class DataSource {
 public:
@@ -33,31 +47,54 @@ public:
 
   /**
    * Use a single set of files containing the entire set of training patches,
-   * coupled with labels indicating where the positive samples are in the data.
-   * Eventually will be used to automatically extract negative data from the
-   * areas that aren't explicitly labeled positive.
-   *
-   * NOTE: Not completely implemented yet.
+   * coupled with labels indicating where the positive samples are in the data
+   * (see WriteLabeledPatchesToFile).  The labels are the positives, and
+   * negatives are drawn at random from every window of every scale of the
+   * frames that doesn't overlap a label (see FrameSet and the --frames_*
+   * flags).
    */
   DataSource(const std::string& frames_file_glob);
 
+  ~DataSource();
+
+  /**
+   * Start reading patches ahead in two background threads (one per label),
+   * each filling a buffer of buffer_size decoded, integrated patches while
+   * the previous buffer is being consumed.  Once started, all reads come
+   * from these buffers.  Started by the constructor if --prefetch_patches.
+   */
+  void StartPrefetch(int buffer_size);
+
+  /**
+   * Stop the prefetch threads, discarding any patches read ahead.
+   */
+  void StopPrefetch();
+
   /**
    * Just get the next max_num_patches patches from the data stream.
    */
   int GetPositivePatches(int max_num_patches, std::vector<Patch>* patches);
   int GetNegativePatches(int max_num_patches, std::vector<Patch>* patches);
+  int GetPositivePatches(int max_num_patches, PatchBatch* patches);
+  int GetNegativePatches(int max_num_patches, PatchBatch* patches);
   
   /**
    * As above, but filter out the patches so only patches that are 'active' in the last
    * chain of classifier c are returned.  Used for getting data for cascade training.
+   * With --mining_frames_glob, cascade negatives are instead mined from
+   * windows of negative-only frames by the detector (see MineNegatives).
    */
   int GetPositivePatchesActive(int max_num_patches, const Classifier& c, std::vector<Patch>* patches);
   int GetNegativePatchesActive(int max_num_patches, const Classifier& c, std::vector<Patch>* patches);
+  int GetPositivePatchesActive(int max_num_patches, const Classifier& c, PatchBatch* patches);
+  int GetNegativePatchesActive(int max_num_patches, const Classifier& c, PatchBatch* patches);
 
   /**
    * Get max_num_patches patches from the data stream, where the patches are
    * sampled according to their current activation using classifier c.
    * The weights vector represents the weights used to adjust for sampling.
+   * With --resample_pool_size, the patches are sampled from pools kept
+   * in memory (see ResamplingPool) instead of the data stream.
    */
   int GetPositivePatchesSampled(int max_num_patches, const Classifier& c,
         			std::vector<float>* weights, std::vector<Patch>* patches);
@@ -65,6 +102,8 @@ public:
         			std::vector<float>* weights, std::vector<Patch>* patches);
   int GetPatchesSampled(int max_num_patches, const Classifier& c,
                         std::vector<float>* weights, std::vector<Patch>* patches);
+  int GetPatchesSampled(int max_num_patches, const Classifier& c,
+                        std::vector<float>* weights, PatchBatch* patches);
 
   /**
    * Grab num_patches patches and use them to estimate the average weight,
@@ -97,30 +136,138 @@ public:
   void set_num_negatives_to_sample(int num) {num_negatives_to_sample_ = num;}
   int num_positives_to_sample() {return num_positives_to_sample_;}
   int num_negatives_to_sample() {return num_negatives_to_sample_;}
+  const ActivationCache* activation_cache() const {return activation_cache_;}
 
 protected:
+  /**
+   * Shared implementations of the functions above.  Exactly one of
+   * patches and batch is non-NULL and receives the output.  If c is
+   * non-NULL only patches active in its last chain are kept.
+   */
+  int GetPatches(bool positive, int max_num_patches, const Classifier* c,
+                 std::vector<Patch>* patches, PatchBatch* batch);
   int GetPatchesSampled(float positive_prob, int max_num_patches, float normalizer, const Classifier& c,
-        		std::vector<float>* weights, std::vector<Patch>* patches);
+        		std::vector<float>* weights, std::vector<Patch>* patches, PatchBatch* batch = NULL);
+  static void AddPatch(Patch* p, std::vector<Patch>* patches, PatchBatch* batch);
 
-  void OpenNextFile(std::vector<std::string>* filenames, int* index, std::ifstream* file);
+  /**
+   * Mine up to max_num_patches hard negatives for cascade c, running the
+   * detector over the frames in --mining_frames_glob in parallel and
+   * keeping up to --mining_windows_per_frame random windows per frame
+   * that are active in c's last chain.  Frames with labels are skipped.
+   * Frames are read a file at a time, in an order reshuffled every pass,
+   * continuing where the last call stopped.  Gives up after a whole pass
+   * finds nothing.
+   */
+  int MineNegatives(int max_num_patches, const Classifier& c,
+                    std::vector<Patch>* patches, PatchBatch* batch);
+
+  /**
+   * Read the next patch of stream, moving on to the next of files if
+   * it has run out (see PatchStream and FileCycle).
+   */
+  static bool ReadPatchAttempt(FileCycle* files, PatchStream* stream, Patch* p);
+  /**
+   * Open and index all of filenames for --random_access.  Returns NULL
+   * (and streaming is used instead) if any of them can't be opened.
+   */
+  static PatchDataset* OpenDataset(const std::vector<std::string>& filenames);
   bool ReadPositivePatchAttempt(Patch *p);
   bool ReadNegativePatchAttempt(Patch *p);
 
   bool CheckDataAgainstFlags(bool positive);
 
+  /**
+   * Create the positive and negative pools for --resample_pool_size,
+   * splitting it by the data set sizes.
+   */
+  void CreateResamplingPools();
+
+  /**
+   * Activation of p under c, through the activation cache if there is
+   * one (see --activation_cache).
+   */
+  float SampledActivation(const Patch& p, const Classifier& c);
+
+  /**
+   * Read a patch from the files and compute its integral image,
+   * retrying up to --max_read_attempts times.  Draws uniformly
+   * random patches if --random_access is set, uses the reader
+   * threads if --reader_threads is set, or draws from the shuffle
+   * buffers if --shuffle_buffer_size is set.
+   */
+  bool ReadPatchFromFile(bool positive, Patch* p);
+
+  /**
+   * Double buffer filled by one prefetch thread.  The thread fills
+   * filling while the reader consumes ready, and the two are swapped
+   * once ready runs out and filling is full.
+   */
+  struct PrefetchBuffer {
+    std::vector<Patch> ready;
+    size_t next;
+    std::vector<Patch> filling;
+    bool full;
+    bool finished;
+    // Set by StopPrefetch, and checked by the thread between reads.
+    std::atomic<bool> stop;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread thread;
+  };
+
+  void PrefetchThread(bool positive);
+  bool ReadPrefetchedPatch(bool positive, Patch* p);
+
   bool frames_mode_;
   
   std::vector<std::string> positive_filenames_;
   std::vector<std::string> negative_filenames_;
 
-  std::ifstream positive_file_;
-  std::ifstream negative_file_;
+  // Fixed number of every file, which the shuffling doesn't change,
+  // for the ids of the patches read from it.
+  std::map<std::string, int> file_numbers_;
 
-  int positive_filenames_index_;
-  int negative_filenames_index_;
+  FileCycle positive_files_;
+  FileCycle negative_files_;
+  PatchStream positive_stream_;
+  PatchStream negative_stream_;
   
   int num_positives_to_sample_;
   int num_negatives_to_sample_;
+
+  PatchReader* positive_reader_;
+  PatchReader* negative_reader_;
+
+  // Buffers shuffling the streamed patches, for --shuffle_buffer_size.
+  ShuffleBuffer* positive_shuffle_;
+  ShuffleBuffer* negative_shuffle_;
+
+  // Indexes of every patch, for --random_access.
+  PatchDataset* positive_dataset_;
+  PatchDataset* negative_dataset_;
+
+  ActivationCache* activation_cache_;
+
+  // Pools for --resample_pool_size, one per label.
+  ResamplingPool* positive_pool_;
+  ResamplingPool* negative_pool_;
+
+  // Frames, labels and pyramids for frames mode, with the order the
+  // positives are streamed in (reshuffled every pass).
+  FrameSet* frames_;
+  std::vector<int> frame_positive_order_;
+  int frame_positive_index_;
+
+  // Negative-only frames for mining, and the next one to read.
+  std::vector<std::string> mining_filenames_;
+  int mining_filenames_index_;
+
+  bool prefetching_;
+  int prefetch_buffer_size_;
+  PrefetchBuffer positive_prefetch_;
+  PrefetchBuffer negative_prefetch_;
 };
 
   // int GetPositivePatchesSampled(int max_num_patches, const Classifier& c,
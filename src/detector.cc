@@ -10,6 +10,8 @@
 #include <cstdlib>
 #include <ctime>
 #include <sstream>
+#include <utility>
+#include <vector>
 
 #include "detector.h"
 #include "feature.h"
@@ -32,7 +34,7 @@ DEFINE_bool(use_average_features, true,
 
 namespace speedboost {
 
-Sequencer::Sequencer(Classifier* c)
+Sequencer::Sequencer(const Classifier* c)
   : c_(c) {
   next_biggest_.resize(c_->chains_.size());
   for (int i = 0; i < (int)(c_->chains_.size()); i++) {
@@ -84,7 +86,7 @@ int Sequencer::NextChain(int current_chain, float activation) const {
   return next_chain;
 }
 
-SingleScaleDetector::SingleScaleDetector(Classifier* c, Patch* integral)
+SingleScaleDetector::SingleScaleDetector(const Classifier* c, Patch* integral)
   : c_(c), integral_(integral),
     chain_index_(0), stump_index_(0),
     default_indices_(),
@@ -237,6 +239,15 @@ void SingleScaleDetector::EvaluateAllPatchesListed(float weight, const DecisionS
   }
 }
 
+const vector<int>& SingleScaleDetector::ActiveWindows() const {
+  // Only filtered chains (after the first) keep their own list.
+  if (chain_index_ > 0 && chain_index_ < (int)(c_->chains_.size()) &&
+      c_->filters_[chain_index_].active_) {
+    return indices_[chain_index_];
+  }
+  return default_indices_;
+}
+
 bool SingleScaleDetector::HasMoreFeatures() {
   return (chain_index_ < (int)(c_->chains_.size())) && (stump_index_ < (int)(c_->chains_[chain_index_].stumps_.size()));
 }
@@ -321,7 +332,7 @@ void SingleScaleDetector::ComputeNextFeature(const Sequencer& sequencer,
   // cout << endl;
 }
 
-Detector::Detector(Classifier* c, float initial_scale, int num_scales, float scaling_factor, float detection_threshold)
+Detector::Detector(const Classifier* c, float initial_scale, int num_scales, float scaling_factor, float detection_threshold)
   : c_(c), sequencer_(c), initial_scale_(initial_scale), num_scales_(num_scales),
     scaling_factor_(scaling_factor), detection_threshold_(detection_threshold)
 {
@@ -335,21 +346,28 @@ void Detector::SetupForFrame(const Patch& frame,
   scaled_activations->clear();
   scaled_detectors->clear();
 
+  scaled_integrals->reserve(num_scales_);
+  scaled_activations->reserve(num_scales_);
+  scaled_detectors->reserve(num_scales_);
+  if (scaled_updates) {
+    scaled_updates->clear();
+    scaled_updates->reserve(num_scales_);
+  }
+
   float current_scale = 1.0 / initial_scale_;
   for (int i = 0; i < num_scales_; i++) {
-    Patch integral(0, frame.width()*current_scale, frame.height()*current_scale, frame.channels());
-    Patch activations(0, frame.width()*current_scale, frame.height()*current_scale, 1);
+    int scaled_width = frame.width()*current_scale;
+    int scaled_height = frame.height()*current_scale;
     Label l(0, 0, frame.width(), frame.height());
 
-    frame.ExtractLabel(l, &integral);
-    integral.ComputeIntegralImage();
+    scaled_integrals->emplace_back(0, scaled_width, scaled_height, frame.channels());
+    frame.ExtractLabel(l, &scaled_integrals->back());
+    scaled_integrals->back().ComputeIntegralImage();
 
-    scaled_integrals->push_back(integral);
-    scaled_activations->push_back(activations);
+    scaled_activations->emplace_back(0, scaled_width, scaled_height, 1);
 
     if (scaled_updates) {
-      Patch updates(0, frame.width()*current_scale, frame.height()*current_scale, 1);
-      scaled_updates->push_back(updates);
+      scaled_updates->emplace_back(0, scaled_width, scaled_height, 1);
     }
 
     current_scale = current_scale / scaling_factor_;
@@ -404,6 +422,47 @@ void Detector::ComputeActivationPyramid(const Patch& frame,
 
 }
 
+void Detector::ComputeActiveWindows(const Patch& frame, int max_windows, unsigned int* seed,
+                                    vector<Patch>* windows) {
+  assert(c_->type_ == Classifier::kCascade && c_->chains_.back().stumps_.empty());
+
+  vector<Patch> scaled_integrals;
+  vector<Patch> scaled_activations;
+  vector<SingleScaleDetector> scaled_detectors;
+  SetupForFrame(frame, &scaled_integrals, &scaled_activations, &scaled_detectors);
+
+  for (int i = 0; i < (int)(scaled_detectors.size()); i++) {
+    while (scaled_detectors[i].HasMoreFeatures()) {
+      scaled_detectors[i].ComputeNextFeature(sequencer_, &scaled_activations[i]);
+    }
+  }
+
+  // Every surviving window, as (level, index in the level).
+  vector< pair<int, int> > active;
+  for (int i = 0; i < (int)(scaled_detectors.size()); i++) {
+    const vector<int>& indices = scaled_detectors[i].ActiveWindows();
+    for (int k = 0; k < (int)(indices.size()); k++) {
+      active.push_back(make_pair(i, indices[k]));
+    }
+  }
+
+  // Partial shuffle to pick a random subset.
+  int num_windows = min(max_windows, (int)(active.size()));
+  for (int k = 0; k < num_windows; k++) {
+    int j = k + rand_r(seed) % (active.size() - k);
+    swap(active[k], active[j]);
+  }
+
+  for (int k = 0; k < num_windows; k++) {
+    const Patch& integral = scaled_integrals[active[k].first];
+    int x = active[k].second % integral.width();
+    int y = active[k].second / integral.width();
+
+    windows->emplace_back();
+    integral.CutIntegralWindow(x, y, FLAGS_patch_width, FLAGS_patch_height, &windows->back());
+  }
+}
+
 void OutputActivation(const Patch& activations, string filename) {
   Patch p(activations);
 
@@ -24,7 +24,7 @@ class Detector;
  */
 class Sequencer {
 public:
-  Sequencer(Classifier* c);
+  Sequencer(const Classifier* c);
   
   /**
    * Given a current chain to start searching at,
@@ -34,7 +34,7 @@ public:
   int NextChain(int current_chain, float activation) const;
   
 private:
-  Classifier* c_;
+  const Classifier* c_;
   
   std::vector<int> next_biggest_;
   std::vector<float> max_threshold_;
@@ -51,7 +51,7 @@ public:
    * These objects should not be freed while SingleScaleDetector is still
    * being used.
    */
-  SingleScaleDetector(Classifier* c, Patch* integral);
+  SingleScaleDetector(const Classifier* c, Patch* integral);
 
   /**
    * Functions to evaluate a decision stump for every patch in the scaled image.
@@ -91,8 +91,16 @@ public:
 
   float NumPixels() { return (float)num_pixels_; }
 
+  /**
+   * Indices (y * width + x) of the windows that reached the chain the
+   * detector stopped at, i.e. passed all the filters before it, once
+   * HasMoreFeatures is false.  Only valid for cascades whose last chain
+   * has no stumps yet.
+   */
+  const std::vector<int>& ActiveWindows() const;
+
 private:
-  Classifier* c_;
+  const Classifier* c_;
   Patch* integral_;
 
   int chain_index_;
@@ -110,7 +118,7 @@ private:
  */
 class Detector {
 public:
-  Detector(Classifier* c, float initial_scale,
+  Detector(const Classifier* c, float initial_scale,
            int num_scales, float scaling_factor, float detection_threshold);
 
   /**
@@ -151,6 +159,18 @@ public:
    */
   void ComputeDetections(const Patch& frame, std::vector<Label>* detections);
 
+  /**
+   * Run the classifier densely over every scale of frame, and cut out
+   * (see Patch::CutIntegralWindow) the windows still active at its last
+   * chain, as Classifier::IsActiveInLastChain would find.  This is for
+   * mining hard negatives while a cascade is being trained, so c must
+   * be a cascade whose last chain has no stumps yet, as in TrainCascade.
+   * If there are more than max_windows, a random subset of them (using
+   * seed, for rand_r) is returned.
+   */
+  void ComputeActiveWindows(const Patch& frame, int max_windows, unsigned int* seed,
+                            std::vector<Patch>* windows);
+
   /**
    * Filter out the overlapping detections.
    */
@@ -174,7 +194,7 @@ protected:
                      std::vector<SingleScaleDetector>* scaled_detectors,
                      std::vector<Patch>* scaled_updates = NULL);
 
-  Classifier* c_;
+  const Classifier* c_;
   Sequencer sequencer_;
 
   float initial_scale_;
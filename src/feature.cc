@@ -60,6 +60,54 @@ float Feature::Evaluate(const Patch& p) const {
 		 (p.Value(b1_.x0_, b1_.y1_, c_) + p.Value(b1_.x1_, b1_.y0_, c_))));
 }
 
+float Feature::Evaluate(const PatchBatch& patches, int i) const {
+  return (w0_*((patches.Value(i, b0_.x0_, b0_.y0_, c_) + patches.Value(i, b0_.x1_, b0_.y1_, c_)) -
+	       (patches.Value(i, b0_.x0_, b0_.y1_, c_) + patches.Value(i, b0_.x1_, b0_.y0_, c_)))
+	  + w1_*((patches.Value(i, b1_.x0_, b1_.y0_, c_) + patches.Value(i, b1_.x1_, b1_.y1_, c_)) -
+		 (patches.Value(i, b1_.x0_, b1_.y1_, c_) + patches.Value(i, b1_.x1_, b1_.y0_, c_))));
+}
+
+void Feature::Evaluate(const PatchBatch& patches, int begin, int end, float* responses) const {
+  if (patches.layout() != PatchBatch::kPixelMajor) {
+    for (int i = begin; i < end; i++) {
+      responses[i - begin] = Evaluate(patches, i);
+    }
+    return;
+  }
+
+  // Each corner is a contiguous row across the patches.
+  const float* a0 = patches.Pixel(b0_.x0_, b0_.y0_, c_) + begin;
+  const float* a1 = patches.Pixel(b0_.x1_, b0_.y1_, c_) + begin;
+  const float* a2 = patches.Pixel(b0_.x0_, b0_.y1_, c_) + begin;
+  const float* a3 = patches.Pixel(b0_.x1_, b0_.y0_, c_) + begin;
+  const float* b0 = patches.Pixel(b1_.x0_, b1_.y0_, c_) + begin;
+  const float* b1 = patches.Pixel(b1_.x1_, b1_.y1_, c_) + begin;
+  const float* b2 = patches.Pixel(b1_.x0_, b1_.y1_, c_) + begin;
+  const float* b3 = patches.Pixel(b1_.x1_, b1_.y0_, c_) + begin;
+  float w0 = w0_;
+  float w1 = w1_;
+  int n = end - begin;
+
+  #pragma omp simd
+  for (int i = 0; i < n; i++) {
+    responses[i] = (w0*((a0[i] + a1[i]) - (a2[i] + a3[i]))
+                    + w1*((b0[i] + b1[i]) - (b2[i] + b3[i])));
+  }
+}
+
+// Patches per block in EvaluateBlock.
+static const int kEvaluateBlockSize = 512;
+
+void Feature::EvaluateBlock(const Feature* features, int num_features,
+                            const PatchBatch& patches, float* const* responses) {
+  for (int begin = 0; begin < patches.size(); begin += kEvaluateBlockSize) {
+    int end = min(begin + kEvaluateBlockSize, patches.size());
+    for (int f = 0; f < num_features; f++) {
+      features[f].Evaluate(patches, begin, end, responses[f] + begin);
+    }
+  }
+}
+
 bool Feature::FromMessage(const FeatureMessage& msg) {
   if (msg.type() != FeatureMessage::HAAR)
     return false;
@@ -15,6 +15,7 @@
 
 #include "feature.pb.h"
 #include "patch.h"
+#include "patch_batch.h"
 
 namespace speedboost {
 
@@ -80,6 +81,27 @@ public:
    */
   float Evaluate(const Patch& p) const;
 
+  /**
+   * Evaluate this feature on patch i of a batch.
+   */
+  float Evaluate(const PatchBatch& patches, int i) const;
+
+  /**
+   * Evaluate this feature on patches [begin, end) of a batch, writing
+   * the response for patch i to responses[i - begin].  Vectorized over
+   * the patches for the pixel-major layout.
+   */
+  void Evaluate(const PatchBatch& patches, int begin, int end, float* responses) const;
+
+  /**
+   * Evaluate num_features features on every patch of a batch, writing
+   * the responses of feature f to responses[f].  The patches are
+   * processed in blocks small enough for their pixels to stay in cache
+   * while every feature is evaluated on them.
+   */
+  static void EvaluateBlock(const Feature* features, int num_features,
+                            const PatchBatch& patches, float* const* responses);
+
   /**
    * Convert to and from protobuf representation.
    */
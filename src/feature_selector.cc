@@ -5,12 +5,16 @@
 //
 
 #include <algorithm>
+#include <cassert>
 #include <cfloat>
 #include <cmath>
+#include <cstdlib>
+#include <omp.h>
 
 #include "feature.h"
 #include "feature_selector.h"
 #include "patch.h"
+#include "util.h"
 
 using namespace std;
 
@@ -19,37 +23,274 @@ DEFINE_int32(threshold_examples_step, 100, "Minimum examples between each thresh
 DEFINE_int32(threshold_min_positive_examples, 50, "Minimum positive examples per each threshold section.");
 DEFINE_int32(threshold_min_negative_examples, 50, "Minimum negative examples per each threshold section.");
 DEFINE_double(threshold_min_delta, 0.01, "Minimum change in threshold per section.");
+DEFINE_string(response_store_directory, "",
+              "If non-empty, keep the feature responses in a memory-mapped file in this "
+              "directory instead of in memory, e.g. for training sets larger than RAM.");
+DEFINE_double(lazy_selection_tolerance, 1e-3,
+              "Slack, as a fraction of the total weight, subtracted from the loss bounds "
+              "used by lazy feature selection to cover floating point rounding.");
+DEFINE_int32(subset_num_bins, 256,
+             "Number of bins (at most 256) each feature's responses are quantized into when "
+             "selecting features on a subset of the examples.  Takes one byte per feature "
+             "per example.");
+DEFINE_int32(bandit_initial_samples, 1000,
+             "Number of weighted samples used to estimate feature errors in the first "
+             "round of bandit feature selection.");
+DEFINE_double(bandit_sample_growth, 2.0,
+              "Factor the bandit feature selection sample grows by each round.");
+DEFINE_double(bandit_confidence, 0.05,
+              "Probability of wrongly eliminating the best feature allowed by the "
+              "confidence intervals in bandit feature selection.");
+DEFINE_double(bandit_keep_fraction, 0.5,
+              "Maximum fraction of features kept each round of bandit feature selection. "
+              "Set to 1 to eliminate only by the confidence intervals.");
+DEFINE_int32(bandit_final_features, 16,
+             "Stop sampling once this many features are left and evaluate them exactly.");
 
 namespace speedboost {
 
+// Number of features evaluated together over each block of patches
+// when filling the response store.
+static const int kFeatureGroupSize = 32;
+
 FeatureSelector::FeatureSelector(const vector<Patch>& patches, const vector<Feature>& feats)
   : labels(patches.size()),
-    responses(feats.size()),
-    sorted(feats.size()),
-    features(&feats)
+    store(),
+    features(&feats),
+    total_log_scale_(0.0),
+    total_decrease_(0.0),
+    num_active_(patches.size()),
+    num_bins_(0)
+{
+  // Evaluating every feature over the pixel-major layout reads each
+  // corner of the feature as a contiguous run across the patches.
+  PatchBatch batch(PatchBatch::kPixelMajor);
+  batch.Append(patches);
+
+  Initialize(batch);
+}
+
+FeatureSelector::FeatureSelector(const PatchBatch& patches, const vector<Feature>& feats)
+  : labels(patches.size()),
+    store(),
+    features(&feats),
+    total_log_scale_(0.0),
+    total_decrease_(0.0),
+    num_active_(patches.size()),
+    num_bins_(0)
 {
-  for (unsigned int p = 0; p < patches.size(); p++) {
-    labels[p] = patches[p].label();
+  Initialize(patches);
+}
+
+void FeatureSelector::Initialize(const PatchBatch& patches)
+{
+  int num_patches = patches.size();
+  for (int p = 0; p < num_patches; p++) {
+    labels[p] = patches.label(p);
+  }
+
+  if (!store.Allocate(features->size(), num_patches, FLAGS_response_store_directory)) {
+    cout << "WARNING: falling back to keeping feature responses in memory." << endl;
+    if (!store.Allocate(features->size(), num_patches, "")) {
+      // There is nowhere to put the responses, and nothing to select without them.
+      cout << "ERROR: unable to allocate the response store for " << features->size()
+           << " features and " << num_patches << " patches, aborting." << endl;
+      abort();
+    }
   }
   
+  // Each thread fills a contiguous range of blocks, so a file backed
+  // store gets written out (and later read back) sequentially.  The
+  // sort scratch space is allocated inside the parallel region, so it is
+  // first touched by, and local to, the thread that uses it.  Features
+  // are evaluated a group at a time, so each block of patches is reused
+  // from cache by every feature in the group.
+  int num_features = features->size();
+  int num_groups = (num_features + kFeatureGroupSize - 1) / kFeatureGroupSize;
+  #pragma omp parallel default(shared)
+  {
+    vector<unsigned int> scratch;
+    vector<float*> responses(kFeatureGroupSize);
+    #pragma omp for schedule(static)
+    for (int g = 0; g < num_groups; g++) {
+      int first = g * kFeatureGroupSize;
+      int count = min(kFeatureGroupSize, num_features - first);
+      for (int k = 0; k < count; k++) {
+        responses[k] = store.responses(first + k);
+      }
+
+      Feature::EvaluateBlock(&(*features)[first], count, patches, &responses[0]);
+
+      for (int k = 0; k < count; k++) {
+        RadixArgsort(responses[k], num_patches, store.sorted(first + k), &scratch);
+      }
+    }
+  }
+}
+
+void FeatureSelector::ReplaceExamples(const vector<int>& slots, const vector<Patch>& new_patches)
+{
+  assert(slots.size() == new_patches.size());
+
+  int num_examples = labels.size();
+  int num_new = slots.size();
+  if (num_new == 0)
+    return;
+
+  ResetLazyState();
+  ClearActiveExamples();
+  bins_.clear();
+
+  vector<char> evicted(num_examples, 0);
+  for (int i = 0; i < num_new; i++) {
+    evicted[slots[i]] = 1;
+    labels[slots[i]] = new_patches[i].label();
+  }
+
+  PatchBatch batch(PatchBatch::kPixelMajor);
+  batch.Append(new_patches);
+
   #pragma omp parallel default(shared)
   {
-    vector< pair<float, int> > sortable(patches.size());
-    #pragma omp for
+    vector<int> kept(num_examples);
+    vector<float> new_responses(num_new);
+    vector<int> new_order(num_new);
+    vector<unsigned int> scratch;
+
+    #pragma omp for schedule(static)
     for (unsigned int f = 0; f < features->size(); f++) {
-      responses[f].resize(patches.size());
-      sorted[f].resize(patches.size());
-      
-      for (unsigned int p = 0; p < patches.size(); p++) {
-        responses[f][p] = (*features)[f].Evaluate(patches[p]);
-        sortable[p].first = (*features)[f].Evaluate(patches[p]);
-        sortable[p].second = p;
+      float* responses = store.responses(f);
+      int* sorted = store.sorted(f);
+
+      // Drop the evicted examples, keeping the rest in order.
+      int num_kept = 0;
+      for (int i = 0; i < num_examples; i++) {
+        if (!evicted[sorted[i]]) {
+          kept[num_kept++] = sorted[i];
+        }
       }
-      
-      sort(sortable.begin(), sortable.end());
-      for (unsigned int p = 0; p < patches.size(); p++) {
-        sorted[f][p] = sortable[p].second;
+
+      (*features)[f].Evaluate(batch, 0, num_new, &new_responses[0]);
+      for (int i = 0; i < num_new; i++) {
+        responses[slots[i]] = new_responses[i];
+      }
+      RadixArgsort(&new_responses[0], num_new, &new_order[0], &scratch);
+
+      // Merge the kept and new examples back into a single sorted order.
+      int k = 0;
+      int n = 0;
+      for (int i = 0; i < num_examples; i++) {
+        bool take_kept;
+        if (k == num_kept) {
+          take_kept = false;
+        } else if (n == num_new) {
+          take_kept = true;
+        } else {
+          float rk = responses[kept[k]];
+          float rn = new_responses[new_order[n]];
+          take_kept = (rk <= rn);
+        }
+
+        if (take_kept) {
+          sorted[i] = kept[k++];
+        } else {
+          sorted[i] = slots[new_order[n++]];
+        }
+      }
+    }
+  }
+}
+
+void FeatureSelector::SetActiveExamples(const vector<int>& active)
+{
+  int num_examples = labels.size();
+  int num_active = active.size();
+
+  ResetLazyState();
+  if (num_active == num_examples) {
+    ClearActiveExamples();
+    return;
+  }
+
+  active_.assign(num_examples, 0);
+  for (int k = 0; k < num_active; k++) {
+    active_[active[k]] = 1;
+  }
+
+  num_active_ = num_active;
+  active_sorted_.resize((size_t)features->size() * num_active);
+
+  #pragma omp parallel default(shared)
+  {
+    // Compact without branching on the mask, into a buffer with room for
+    // one extra write past the end.
+    vector<int> buffer(num_active + 1);
+
+    #pragma omp for schedule(static)
+    for (unsigned int f = 0; f < features->size(); f++) {
+      const int* sorted = store.sorted(f);
+
+      int k = 0;
+      for (int i = 0; i < num_examples; i++) {
+        buffer[k] = sorted[i];
+        k += active_[sorted[i]];
       }
+
+      copy(buffer.begin(), buffer.begin() + num_active, active_sorted_.begin() + (size_t)f * num_active);
+    }
+  }
+}
+
+void FeatureSelector::ClearActiveExamples()
+{
+  if (!active_.empty()) {
+    ResetLazyState();
+  }
+
+  active_.clear();
+  active_sorted_.clear();
+  num_active_ = labels.size();
+}
+
+const int* FeatureSelector::SortedOrder(int index, int* num_sorted) const
+{
+  if (active_.empty()) {
+    *num_sorted = labels.size();
+    return store.sorted(index);
+  }
+
+  *num_sorted = num_active_;
+  return &active_sorted_[(size_t)index * num_active_];
+}
+
+void TrimWeights(const vector<float>& weights, float tail_mass, vector<int>* active)
+{
+  int num_examples = weights.size();
+
+  vector< pair<float, int> > sortable(num_examples);
+  double total = 0.0;
+  for (int i = 0; i < num_examples; i++) {
+    sortable[i].first = weights[i];
+    sortable[i].second = i;
+    total += weights[i];
+  }
+
+  sort(sortable.begin(), sortable.end());
+
+  // Drop the lightest examples as long as their total stays within the tail.
+  vector<char> trimmed(num_examples, 0);
+  double trimmed_weight = 0.0;
+  for (int i = 0; i < num_examples; i++) {
+    trimmed_weight += sortable[i].first;
+    if (trimmed_weight > tail_mass * total)
+      break;
+    trimmed[sortable[i].second] = 1;
+  }
+
+  active->clear();
+  for (int i = 0; i < num_examples; i++) {
+    if (!trimmed[i]) {
+      active->push_back(i);
     }
   }
 }
@@ -67,9 +308,13 @@ void FeatureSelector::SelectFeatureSingle(const vector<float>& weights, const ve
   float best_sign = (positive_weight_above > negative_weight_above) ? 1 : -1;
   float best_loss = min(positive_weight_above, negative_weight_above);
 
-  for (unsigned int i = 1; i < responses[index].size(); i++) {
-    int p1 = sorted[index][i - 1];
-    int p2 = sorted[index][i];
+  const float* responses = store.responses(index);
+  int num_sorted;
+  const int* sorted = SortedOrder(index, &num_sorted);
+
+  for (int i = 1; i < num_sorted; i++) {
+    int p1 = sorted[i - 1];
+    int p2 = sorted[i];
 
     if (labels[p1] > 0) {
       positive_weight_above -= weights[p1];
@@ -79,7 +324,7 @@ void FeatureSelector::SelectFeatureSingle(const vector<float>& weights, const ve
       negative_weight_below += weights[p1];
     }
 
-    if (responses[index][p1] == responses[index][p2]) continue;
+    if (responses[p1] == responses[p2]) continue;
 
     float positive_loss = negative_weight_above + positive_weight_below;
     float negative_loss = positive_weight_above + negative_weight_below;
@@ -87,7 +332,7 @@ void FeatureSelector::SelectFeatureSingle(const vector<float>& weights, const ve
     if (best_loss > min(positive_loss, negative_loss)) {
       best_loss = min(positive_loss, negative_loss);
       best_sign = (positive_loss < negative_loss) ? 1 : -1;
-      best_split = (responses[index][p1] + responses[index][p2]) / 2.0;
+      best_split = (responses[p1] + responses[p2]) / 2.0;
     }
   }
 
@@ -123,9 +368,13 @@ void FeatureSelector::SelectFeatureBucketedSingle(const vector<float>& weights,
   //    (positive_weight[num_buckets - 1] + negative_weight[num_buckets - 1]);
   //  float best_threshold = max_threshold;
 
-  for (unsigned int i = 1; i < responses[index].size(); i++) {
-    int p1 = sorted[index][i - 1];
-    int p2 = sorted[index][i];
+  const float* responses = store.responses(index);
+  int num_sorted;
+  const int* sorted = SortedOrder(index, &num_sorted);
+
+  for (int i = 1; i < num_sorted; i++) {
+    int p1 = sorted[i - 1];
+    int p2 = sorted[i];
 
     if (labels[p1] > 0) {
       for (int b = buckets[p1]; b < num_buckets; b++) {
@@ -137,7 +386,7 @@ void FeatureSelector::SelectFeatureBucketedSingle(const vector<float>& weights,
       }
     }
 
-    if (responses[index][p1] == responses[index][p2]) continue;
+    if (responses[p1] == responses[p2]) continue;
 
     // cout << "example " << i << " bucket: " << bucket << ", activation: " << activations[p1]
     //      << ", label: " << (int)labels[p1] << ", weight: " << weights[p1] << endl;
@@ -185,11 +434,11 @@ void FeatureSelector::SelectFeatureBucketedSingle(const vector<float>& weights,
   if (i == 0) {
     sum = FLT_MIN;
   } else {
-    sum = responses[index][sorted[index][i - 1]];
-    while ((i < num_buckets) && (buckets[sorted[index][i]] > best_bucket)) {
+    sum = responses[sorted[i - 1]];
+    while ((i < num_buckets) && (buckets[sorted[i]] > best_bucket)) {
       i++;
     }
-    sum += responses[index][sorted[index][i]];
+    sum += responses[sorted[i]];
   }
 
   *gain = best_gain;
@@ -205,8 +454,9 @@ void FeatureSelector::UpdateActivations(const DecisionStump& feature, const Filt
 {
   cout << "Updating activations: " << endl;
   cout << "index: " << index << " alpha: " << alpha << endl;
+  const float* responses = store.responses(index);
   for (unsigned int i = 0; i < activations->size(); i++) {
-    float response = responses[index][i];
+    float response = responses[i];
     
     if (filter.PassesFilter(abs((*activations)[i]))) {
       (*activations)[i] += alpha * feature.Evaluate(response);
@@ -214,6 +464,61 @@ void FeatureSelector::UpdateActivations(const DecisionStump& feature, const Filt
   }
 }
 
+void FeatureSelector::UpdateRound(const DecisionStump& feature, const Filter& filter,
+                                  int index, float alpha, const vector<float>& sample_weights,
+                                  vector<float>* activations, vector<float>* weights,
+                                  LossStatistics* stats)
+{
+  int num_examples = labels.size();
+  bool use_sample_weights = (sample_weights.size() == activations->size());
+
+  const float* responses = store.responses(index);
+  const char* y = &labels[0];
+  const float* s = use_sample_weights ? &sample_weights[0] : NULL;
+  float* a = &(*activations)[0];
+  float* w = &(*weights)[0];
+
+  // Only the stump's parameters are needed, so the loop doesn't call
+  // out of line functions and can be vectorized.
+  float split = feature.split_;
+  float step = alpha * feature.sign_;
+
+  double exp_loss = 0.0;
+  double positive_count = 0.0;
+  double negative_count = 0.0;
+  double positive_errors = 0.0;
+  double negative_errors = 0.0;
+
+  #pragma omp parallel for simd schedule(static) \
+    reduction(+:exp_loss, positive_count, negative_count, positive_errors, negative_errors)
+  for (int i = 0; i < num_examples; i++) {
+    float activation = a[i];
+    float update = (responses[i] < split) ? -step : step;
+    activation += filter.PassesFilter(fabs(activation)) ? update : 0.0f;
+    a[i] = activation;
+
+    float positive = (y[i] > 0) ? 1.0f : 0.0f;
+    float margin = (y[i] > 0) ? activation : -activation;
+    float sample_weight = use_sample_weights ? s[i] : 1.0f;
+    float weight = sample_weight * FastExp(-margin);
+    w[i] = weight;
+
+    // Same sign convention as ZeroOneLoss: zero counts as negative.
+    float error = ((activation > 0) != (positive > 0)) ? sample_weight : 0.0f;
+
+    exp_loss += weight;
+    positive_count += positive * sample_weight;
+    negative_count += (1.0f - positive) * sample_weight;
+    positive_errors += positive * error;
+    negative_errors += (1.0f - positive) * error;
+  }
+
+  stats->exp_loss = exp_loss;
+  stats->zero_one_loss = (positive_errors + negative_errors) / (positive_count + negative_count);
+  stats->positive_loss = positive_errors / positive_count;
+  stats->negative_loss = negative_errors / negative_count;
+}
+
 DecisionStump FeatureSelector::SelectFeature(const vector<float>& weights, const vector<float>& activations,
                                               int *index, float* err)
 {
@@ -221,6 +526,8 @@ DecisionStump FeatureSelector::SelectFeature(const vector<float>& weights, const
   float negative_weight = 0.0;
 
   for (unsigned int i = 0; i < weights.size(); i++) {
+    if (!IsActive(i)) continue;
+
     if (labels[i] > 0) {
       positive_weight += weights[i];
     } else {
@@ -237,12 +544,13 @@ DecisionStump FeatureSelector::SelectFeature(const vector<float>& weights, const
   vector<float> splits(features->size());
   vector<float> signs(features->size());
 
-  #pragma omp parallel for
+  #pragma omp parallel for schedule(static)
   for (unsigned int i = 0; i < features->size(); i++) {
     float loss;
     float split;
     float sign;
-    
+
+    store.Prefetch(i + 1);
     SelectFeatureSingle(weights, activations, i, positive_weight, negative_weight,
                         &split, &sign, &loss);
     losses[i] = loss;
@@ -269,6 +577,533 @@ DecisionStump FeatureSelector::SelectFeature(const vector<float>& weights, const
   return lf;
 }
 
+void FeatureSelector::ResetLazyState()
+{
+  cached_losses_.clear();
+  cached_log_scales_.clear();
+  cached_decreases_.clear();
+  last_weights_.clear();
+  total_log_scale_ = 0.0;
+  total_decrease_ = 0.0;
+}
+
+DecisionStump FeatureSelector::SelectFeatureLazy(const vector<float>& weights, const vector<float>& activations,
+                                                  int *index, float* err)
+{
+  int num_features = features->size();
+
+  if (last_weights_.size() != weights.size()) {
+    // Nothing cached yet, so evaluate everything.
+    ResetLazyState();
+    cached_losses_.resize(num_features, 0.0);
+    cached_log_scales_.resize(num_features, 0.0);
+    cached_decreases_.resize(num_features, 0.0);
+  } else {
+    // Any split's loss can shrink by at most the smallest factor any single
+    // weight was scaled by, and by at most the total weight decrease.
+    float min_scale = FLT_MAX;
+    double decrease = 0.0;
+    for (unsigned int i = 0; i < weights.size(); i++) {
+      if (last_weights_[i] > 0) {
+        min_scale = min(min_scale, weights[i] / last_weights_[i]);
+      }
+      if (weights[i] < last_weights_[i]) {
+        decrease += last_weights_[i] - weights[i];
+      }
+    }
+
+    total_log_scale_ += log(max(min(min_scale, 1.0f), FLT_MIN));
+    total_decrease_ += decrease;
+  }
+  last_weights_ = weights;
+
+  float positive_weight = 0.0;
+  float negative_weight = 0.0;
+
+  for (unsigned int i = 0; i < weights.size(); i++) {
+    if (!IsActive(i)) continue;
+
+    if (labels[i] > 0) {
+      positive_weight += weights[i];
+    } else {
+      negative_weight += weights[i];
+    }
+  }
+
+  float tolerance = FLAGS_lazy_selection_tolerance * (positive_weight + negative_weight);
+  vector<float> bounds(num_features);
+  for (int f = 0; f < num_features; f++) {
+    float scaled = cached_losses_[f] * exp(total_log_scale_ - cached_log_scales_[f]);
+    float shifted = cached_losses_[f] - (total_decrease_ - cached_decreases_[f]);
+    bounds[f] = max(scaled, shifted) - tolerance;
+  }
+
+  vector<int> order(num_features);
+  vector<unsigned int> scratch;
+  RadixArgsort(&bounds[0], num_features, &order[0], &scratch);
+
+  float best_loss = FLT_MAX;
+  int best_feature = -1;
+  float best_split = 0.0;
+  float best_sign = 1.0;
+
+  // Evaluate in batches so the work is still spread over all the threads.
+  int batch_size = 16;
+  #pragma omp parallel
+  {
+    #pragma omp single
+    batch_size = max(batch_size, 4 * omp_get_num_threads());
+  }
+
+  vector<float> losses(batch_size);
+  vector<float> splits(batch_size);
+  vector<float> signs(batch_size);
+
+  int num_evaluated = 0;
+  while (num_evaluated < num_features && bounds[order[num_evaluated]] <= best_loss) {
+    int batch_end = num_evaluated;
+    while (batch_end < num_features && batch_end - num_evaluated < batch_size &&
+           bounds[order[batch_end]] <= best_loss) {
+      batch_end++;
+    }
+
+    #pragma omp parallel for
+    for (int b = num_evaluated; b < batch_end; b++) {
+      int f = order[b];
+      SelectFeatureSingle(weights, activations, f, positive_weight, negative_weight,
+                          &splits[b - num_evaluated], &signs[b - num_evaluated], &losses[b - num_evaluated]);
+    }
+
+    for (int b = num_evaluated; b < batch_end; b++) {
+      int f = order[b];
+      float loss = losses[b - num_evaluated];
+
+      cached_losses_[f] = loss;
+      cached_log_scales_[f] = total_log_scale_;
+      cached_decreases_[f] = total_decrease_;
+
+      // Break ties by index, to pick the same feature as SelectFeature.
+      if (loss < best_loss || (loss == best_loss && f < best_feature)) {
+        best_loss = loss;
+        best_feature = f;
+        best_split = splits[b - num_evaluated];
+        best_sign = signs[b - num_evaluated];
+      }
+    }
+
+    num_evaluated = batch_end;
+  }
+
+  cout << "Lazy selection evaluated " << num_evaluated << " of " << num_features << " features." << endl;
+
+  DecisionStump lf((*features)[best_feature],
+		   best_split,
+		   best_sign);
+
+  *index = best_feature;
+  *err = best_loss / (positive_weight + negative_weight);
+
+  return lf;
+}
+
+void FeatureSelector::SelectFeatureSampleSingle(int index, const vector<int>& sample,
+                                                const vector<float>& sample_weights,
+                                                float positive_weight, float negative_weight,
+                                                vector<float>* sample_responses, vector<int>* order,
+                                                vector<unsigned int>* scratch,
+                                                float* split, float* sign, float* loss) const
+{
+  int num_samples = sample.size();
+  const float* responses = store.responses(index);
+
+  for (int k = 0; k < num_samples; k++) {
+    (*sample_responses)[k] = responses[sample[k]];
+  }
+  RadixArgsort(&(*sample_responses)[0], num_samples, &(*order)[0], scratch);
+
+  float positive_weight_below = 0.0;
+  float negative_weight_below = 0.0;
+  float positive_weight_above = positive_weight;
+  float negative_weight_above = negative_weight;
+
+  float best_split = FLT_MIN;
+  float best_sign = (positive_weight_above > negative_weight_above) ? 1 : -1;
+  float best_loss = min(positive_weight_above, negative_weight_above);
+
+  for (int k = 1; k < num_samples; k++) {
+    int k1 = (*order)[k - 1];
+    int k2 = (*order)[k];
+
+    if (labels[sample[k1]] > 0) {
+      positive_weight_above -= sample_weights[k1];
+      positive_weight_below += sample_weights[k1];
+    } else {
+      negative_weight_above -= sample_weights[k1];
+      negative_weight_below += sample_weights[k1];
+    }
+
+    float r1 = (*sample_responses)[k1];
+    float r2 = (*sample_responses)[k2];
+    if (r1 == r2) continue;
+
+    float positive_loss = negative_weight_above + positive_weight_below;
+    float negative_loss = positive_weight_above + negative_weight_below;
+
+    if (best_loss > min(positive_loss, negative_loss)) {
+      best_loss = min(positive_loss, negative_loss);
+      best_sign = (positive_loss < negative_loss) ? 1 : -1;
+      best_split = (r1 + r2) / 2.0;
+    }
+  }
+
+  *loss = best_loss;
+  *split = best_split;
+  *sign = best_sign;
+}
+
+void FeatureSelector::BuildBins()
+{
+  int num_examples = labels.size();
+  num_bins_ = max(2, min(256, FLAGS_subset_num_bins));
+
+  bins_.resize((size_t)features->size() * num_examples);
+  bin_splits_.resize((size_t)features->size() * num_bins_);
+
+  #pragma omp parallel for schedule(static)
+  for (unsigned int f = 0; f < features->size(); f++) {
+    const float* responses = store.responses(f);
+    const int* sorted = store.sorted(f);
+    unsigned char* bins = &bins_[(size_t)f * num_examples];
+    float* splits = &bin_splits_[(size_t)f * num_bins_];
+
+    // Start a new bin once the current one is full, but never between
+    // equal responses.
+    int bin = 0;
+    for (int i = 0; i < num_examples; i++) {
+      int p = sorted[i];
+      if (i > 0 && bin < (long long)i * num_bins_ / num_examples &&
+          responses[sorted[i - 1]] != responses[p]) {
+        splits[bin] = (responses[sorted[i - 1]] + responses[p]) / 2.0;
+        bin++;
+      }
+      bins[p] = bin;
+    }
+
+    for (int b = bin; b < num_bins_; b++) {
+      splits[b] = FLT_MAX;
+    }
+  }
+
+  cout << "Built " << num_bins_ << " bins per feature for subset selection." << endl;
+}
+
+void FeatureSelector::SelectFeatureHistogramSingle(int index, const vector<int>& subset,
+                                                   const vector<float>& subset_weights,
+                                                   const vector<char>& subset_positive,
+                                                   float positive_weight, float negative_weight,
+                                                   vector<float>* histogram,
+                                                   float* split, float* sign, float* loss) const
+{
+  int num_subset = subset.size();
+  const unsigned char* bins = &bins_[(size_t)index * labels.size()];
+  const float* splits = &bin_splits_[(size_t)index * num_bins_];
+
+  // Negative weight in even entries, positive weight in odd ones.
+  fill(histogram->begin(), histogram->end(), 0.0f);
+  for (int k = 0; k < num_subset; k++) {
+    (*histogram)[2 * bins[subset[k]] + subset_positive[k]] += subset_weights[k];
+  }
+
+  float positive_weight_below = 0.0;
+  float negative_weight_below = 0.0;
+  float positive_weight_above = positive_weight;
+  float negative_weight_above = negative_weight;
+
+  float best_split = FLT_MIN;
+  float best_sign = (positive_weight_above > negative_weight_above) ? 1 : -1;
+  float best_loss = min(positive_weight_above, negative_weight_above);
+
+  for (int b = 0; b < num_bins_ - 1 && splits[b] < FLT_MAX; b++) {
+    negative_weight_above -= (*histogram)[2 * b];
+    negative_weight_below += (*histogram)[2 * b];
+    positive_weight_above -= (*histogram)[2 * b + 1];
+    positive_weight_below += (*histogram)[2 * b + 1];
+
+    float positive_loss = negative_weight_above + positive_weight_below;
+    float negative_loss = positive_weight_above + negative_weight_below;
+
+    if (best_loss > min(positive_loss, negative_loss)) {
+      best_loss = min(positive_loss, negative_loss);
+      best_sign = (positive_loss < negative_loss) ? 1 : -1;
+      best_split = splits[b];
+    }
+  }
+
+  *loss = best_loss;
+  *split = best_split;
+  *sign = best_sign;
+}
+
+DecisionStump FeatureSelector::SelectFeatureSubset(const vector<int>& subset, const vector<float>& subset_weights,
+                                                    int *index, float* err)
+{
+  assert(subset.size() == subset_weights.size());
+
+  int num_subset = subset.size();
+  float positive_weight = 0.0;
+  float negative_weight = 0.0;
+
+  for (int k = 0; k < num_subset; k++) {
+    if (labels[subset[k]] > 0) {
+      positive_weight += subset_weights[k];
+    } else {
+      negative_weight += subset_weights[k];
+    }
+  }
+
+  vector<float> losses(features->size());
+  vector<float> splits(features->size());
+  vector<float> signs(features->size());
+
+  if (bins_.empty()) {
+    BuildBins();
+  }
+
+  vector<char> subset_positive(num_subset);
+  for (int k = 0; k < num_subset; k++) {
+    subset_positive[k] = (labels[subset[k]] > 0) ? 1 : 0;
+  }
+
+  #pragma omp parallel default(shared)
+  {
+    vector<float> histogram(2 * num_bins_);
+
+    #pragma omp for schedule(static)
+    for (unsigned int i = 0; i < features->size(); i++) {
+      SelectFeatureHistogramSingle(i, subset, subset_weights, subset_positive,
+                                   positive_weight, negative_weight, &histogram,
+                                   &splits[i], &signs[i], &losses[i]);
+    }
+  }
+
+  float best_loss = FLT_MAX;
+  int best_feature = -1;
+  float best_split = 0.0;
+  float best_sign = 1.0;
+
+  for (unsigned int i = 0; i < features->size(); i++) {
+    if (losses[i] < best_loss) {
+      best_loss = losses[i];
+      best_feature = i;
+      best_split = splits[i];
+      best_sign = signs[i];
+    }
+  }
+
+  DecisionStump lf((*features)[best_feature],
+		   best_split,
+		   best_sign);
+
+  *index = best_feature;
+  *err = best_loss / (positive_weight + negative_weight);
+
+  return lf;
+}
+
+void GossSample(const vector<float>& weights, float top_fraction, float other_fraction,
+                vector<int>* subset, vector<float>* subset_weights)
+{
+  int num_examples = weights.size();
+  int num_top = min(num_examples, (int)(top_fraction * num_examples));
+  int num_other = min(num_examples - num_top, (int)(other_fraction * num_examples));
+
+  subset->clear();
+  subset_weights->clear();
+
+  // 0 = dropped, 1 = kept as is, 2 = sampled from the rest.
+  vector<char> kept(num_examples, 0);
+  float scale = 1.0;
+
+  if (num_top + num_other >= num_examples) {
+    fill(kept.begin(), kept.end(), 1);
+  } else {
+    // Negate the weights so the largest come first.
+    vector< pair<float, int> > sortable(num_examples);
+    for (int i = 0; i < num_examples; i++) {
+      sortable[i].first = -weights[i];
+      sortable[i].second = i;
+    }
+
+    // Partial sort is enough, we only need to know which are on top.
+    nth_element(sortable.begin(), sortable.begin() + num_top, sortable.end());
+    for (int i = 0; i < num_top; i++) {
+      kept[sortable[i].second] = 1;
+    }
+
+    random_shuffle(sortable.begin() + num_top, sortable.end());
+    for (int i = num_top; i < num_top + num_other; i++) {
+      kept[sortable[i].second] = 2;
+    }
+
+    if (num_other > 0) {
+      scale = (float)(num_examples - num_top) / (float)num_other;
+    }
+  }
+
+  for (int i = 0; i < num_examples; i++) {
+    if (kept[i]) {
+      subset->push_back(i);
+      subset_weights->push_back((kept[i] == 2) ? scale * weights[i] : weights[i]);
+    }
+  }
+}
+
+DecisionStump FeatureSelector::SelectFeatureBandit(const vector<float>& weights, const vector<float>& activations,
+                                                    int *index, float* err)
+{
+  int num_features = features->size();
+  int num_examples = weights.size();
+
+  float positive_weight = 0.0;
+  float negative_weight = 0.0;
+
+  for (int i = 0; i < num_examples; i++) {
+    if (labels[i] > 0) {
+      positive_weight += weights[i];
+    } else {
+      negative_weight += weights[i];
+    }
+  }
+  float total_weight = positive_weight + negative_weight;
+
+  // Union bound over every feature in every round.
+  int num_rounds = 1;
+  for (double m = FLAGS_bandit_initial_samples; m < num_examples; m *= FLAGS_bandit_sample_growth) {
+    num_rounds++;
+  }
+  double log_term = log(2.0 * num_features * num_rounds / FLAGS_bandit_confidence);
+
+  vector<int> arms(num_features);
+  for (int f = 0; f < num_features; f++) {
+    arms[f] = f;
+  }
+
+  vector<float> estimates(num_features);
+  vector<int> sample;
+  long long sampled_work = 0;
+  int round = 0;
+  double num_samples = FLAGS_bandit_initial_samples;
+
+  while ((int)arms.size() > FLAGS_bandit_final_features && num_samples < num_examples) {
+    int m = (int)num_samples;
+
+    // Systematic weighted sample, so each sampled example counts equally.
+    sample.clear();
+    double step = (double)total_weight / m;
+    double next = step * (double)rand() / (double)RAND_MAX;
+    double cumulative = 0.0;
+    for (int i = 0; i < num_examples && (int)sample.size() < m; i++) {
+      cumulative += weights[i];
+      while (next < cumulative && (int)sample.size() < m) {
+        sample.push_back(i);
+        next += step;
+      }
+    }
+    m = sample.size();
+    if (m == 0)
+      break;
+
+    int num_arms = arms.size();
+    int num_positive = 0;
+    for (int k = 0; k < m; k++) {
+      if (labels[sample[k]] > 0)
+        num_positive++;
+    }
+    vector<float> sample_weights(m, 1.0);
+
+    #pragma omp parallel default(shared)
+    {
+      vector<float> sample_responses(m);
+      vector<int> order(m);
+      vector<unsigned int> scratch;
+
+      #pragma omp for schedule(static)
+      for (int a = 0; a < num_arms; a++) {
+        float split, sign, loss;
+        SelectFeatureSampleSingle(arms[a], sample, sample_weights, num_positive, m - num_positive,
+                                  &sample_responses, &order, &scratch, &split, &sign, &loss);
+        estimates[a] = loss / m;
+      }
+    }
+    sampled_work += (long long)num_arms * m;
+
+    // Drop the arms that are confidently worse than the best, then keep
+    // only the best fraction of the rest.
+    float best_estimate = *min_element(estimates.begin(), estimates.begin() + num_arms);
+    float radius = sqrt(log_term / (2.0 * m));
+
+    vector<int> ranked(num_arms);
+    vector<unsigned int> scratch;
+    RadixArgsort(&estimates[0], num_arms, &ranked[0], &scratch);
+
+    int num_kept = (int)ceil(FLAGS_bandit_keep_fraction * num_arms);
+    num_kept = max(num_kept, FLAGS_bandit_final_features);
+
+    vector<int> survivors;
+    for (int r = 0; r < num_arms && (int)survivors.size() < num_kept; r++) {
+      if (estimates[ranked[r]] > best_estimate + 2 * radius) break;
+      survivors.push_back(arms[ranked[r]]);
+    }
+    arms.swap(survivors);
+
+    round++;
+    num_samples *= FLAGS_bandit_sample_growth;
+  }
+
+  // Finish with an exact search over the survivors, in index order so
+  // ties go to the same feature SelectFeature would pick.
+  sort(arms.begin(), arms.end());
+  int num_arms = arms.size();
+
+  vector<float> losses(num_arms);
+  vector<float> splits(num_arms);
+  vector<float> signs(num_arms);
+
+  #pragma omp parallel for schedule(static)
+  for (int a = 0; a < num_arms; a++) {
+    SelectFeatureSingle(weights, activations, arms[a], positive_weight, negative_weight,
+                        &splits[a], &signs[a], &losses[a]);
+  }
+
+  float best_loss = FLT_MAX;
+  int best_feature = -1;
+  float best_split = 0.0;
+  float best_sign = 1.0;
+
+  for (int a = 0; a < num_arms; a++) {
+    if (losses[a] < best_loss) {
+      best_loss = losses[a];
+      best_feature = arms[a];
+      best_split = splits[a];
+      best_sign = signs[a];
+    }
+  }
+
+  cout << "Bandit selection: " << round << " sampling rounds, "
+       << num_arms << " features evaluated exactly, "
+       << (sampled_work + (long long)num_arms * num_examples) * 100 / ((long long)num_features * num_examples)
+       << "% of the full search." << endl;
+
+  DecisionStump lf((*features)[best_feature],
+		   best_split,
+		   best_sign);
+
+  *index = best_feature;
+  *err = best_loss / total_weight;
+
+  return lf;
+}
+
 int Bucket(float activation, float min_threshold, float max_threshold, int num_buckets)
 {
   float fraction = (abs(activation) - min_threshold) / (max_threshold - min_threshold);
@@ -390,15 +1225,18 @@ DecisionStump FeatureSelector::SelectFeatureAndThreshold(const vector<float>& we
   vector<float> tau(num_buckets);
   vector<float> loss(num_buckets);
 
+  // Trimmed examples still count towards the cost of each bucket, but
+  // not towards its weight.
   for (unsigned int i = 0; i < weights.size(); i++) {
+    float w = IsActive(i) ? weights[i] : 0.0;
     if (labels[i] > 0) {
       for (int b = buckets[i]; b < num_buckets; b++) {
-        positive_weight[b] += weights[i];
+        positive_weight[b] += w;
         tau[b] += 1;
       }
     } else {
       for (int b = buckets[i]; b < num_buckets; b++) {
-        negative_weight[b] += weights[i];
+        negative_weight[b] += w;
         tau[b] += 1;
       }
     }
@@ -435,14 +1273,15 @@ DecisionStump FeatureSelector::SelectFeatureAndThreshold(const vector<float>& we
   vector<float> signs(features->size());
   vector<int> best_buckets(features->size());
 
-  #pragma omp parallel for
+  #pragma omp parallel for schedule(static)
   for (unsigned int i = 0; i < features->size(); i++) {
     float error;
     float gain;
     float split;
     float sign;
     int bucket;
-    
+
+    store.Prefetch(i + 1);
     SelectFeatureBucketedSingle(weights, activations, i, buckets,
                                 positive_weight, negative_weight, loss, tau,
                                 &split, &sign, &error, &gain, &bucket);
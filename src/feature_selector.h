@@ -12,12 +12,39 @@
 #include "classifier.h"
 #include "feature.h"
 #include "patch.h"
+#include "patch_batch.h"
+#include "response_store.h"
 
 namespace speedboost {
 
 class FeatureSelector {
 public:
   FeatureSelector(const std::vector<Patch>& patches, const std::vector<Feature>& features);
+  FeatureSelector(const PatchBatch& patches, const std::vector<Feature>& features);
+
+  /**
+   * Replace the examples at the given slots with new_patches, so that
+   * slots[i] now holds new_patches[i].  Instead of re-sorting from scratch,
+   * the evicted examples are dropped from each feature's sorted order and
+   * the (sorted) new examples are merged back in.
+   */
+  void ReplaceExamples(const std::vector<int>& slots, const std::vector<Patch>& new_patches);
+
+  /**
+   * Restrict SelectFeature, SelectFeatureLazy and SelectFeatureAndThreshold
+   * to the given examples, e.g. to skip examples with negligible weight.
+   * Builds a sorted order of just those examples for each feature, so it
+   * is meant to be called every few rounds rather than every round.
+   */
+  void SetActiveExamples(const std::vector<int>& active);
+
+  /**
+   * Go back to using all of the examples.
+   */
+  void ClearActiveExamples();
+
+  inline bool IsActive(int i) const { return active_.empty() || active_[i]; }
+  inline int num_active() const { return num_active_; }
 
   void SelectFeatureSingle(const std::vector<float>& weights, const std::vector<float>& activations,
                            int index, float positive_weight, float negative_weight,
@@ -29,19 +56,149 @@ public:
                                    float* split, float* sign, float* err, float *gain, int* bucket);
   DecisionStump SelectFeature(const std::vector<float>& weights, const std::vector<float>& activations,
                                int* index, float* err);
+
+  /**
+   * Selects the same stump as SelectFeature, but avoids re-evaluating every
+   * feature each round.  The loss of each feature is cached, and the change
+   * in weights since then gives a lower bound on its current loss.  Features
+   * are re-evaluated in order of their bounds until no remaining bound
+   * can match the best loss found so far.
+   */
+  DecisionStump SelectFeatureLazy(const std::vector<float>& weights, const std::vector<float>& activations,
+                                  int* index, float* err);
+
+  /**
+   * Approximate version of SelectFeature that treats the features as arms
+   * of a bandit.  Each round draws a weighted sample of the examples,
+   * estimates the error of every remaining feature on it, and drops the
+   * features that are confidently worse than the best one, keeping at
+   * most a fixed fraction of them.  The sample grows every round until
+   * only a few features are left, which are then evaluated exactly.
+   */
+  DecisionStump SelectFeatureBandit(const std::vector<float>& weights, const std::vector<float>& activations,
+                                    int* index, float* err);
+
+  /**
+   * Same as SelectFeature, but only looks at the examples in subset, with
+   * subset[k] weighted by subset_weights[k].  The responses are binned
+   * (see --subset_num_bins) so the cost of each feature scales with the
+   * subset size, at the price of only splitting between bins.
+   */
+  DecisionStump SelectFeatureSubset(const std::vector<int>& subset, const std::vector<float>& subset_weights,
+                                    int* index, float* err);
   DecisionStump SelectFeatureAndThreshold(const std::vector<float>& weights, const std::vector<float>& activations,
                                            int* index, float* err, float* threshold);
   
   void UpdateActivations(const DecisionStump& feature, const Filter& filter,
                          int index, float alpha, std::vector<float>* activations);
+
+  /**
+   * Fused UpdateActivations, Gradient, ExpLoss and ZeroOneLoss for the
+   * training examples: adds the selected stump to the activations,
+   * recomputes the weights and accumulates the losses in a single
+   * parallel pass.  sample_weights are used if they are the same size
+   * as activations.
+   */
+  void UpdateRound(const DecisionStump& feature, const Filter& filter,
+                   int index, float alpha, const std::vector<float>& sample_weights,
+                   std::vector<float>* activations, std::vector<float>* weights,
+                   LossStatistics* stats);
   
   std::vector<char> labels;
-  std::vector< std::vector<float> > responses;
-  std::vector< std::vector<int> > sorted;
+
+  // Feature responses and sorted example orders, one block per feature.
+  ResponseStore store;
 
   const std::vector<Feature>* features;
+
+protected:
+  /**
+   * Fill in the labels, responses and sorted orders for the given patches.
+   */
+  void Initialize(const PatchBatch& patches);
+
+  /**
+   * Sorted order of the active examples for feature index.
+   */
+  const int* SortedOrder(int index, int* num_sorted) const;
+
+  /**
+   * Best split of feature index over a sample of the examples, where
+   * sample[k] has weight sample_weights[k].  The sample may contain
+   * repeated examples.  The buffers are scratch space sized to the sample.
+   */
+  void SelectFeatureSampleSingle(int index, const std::vector<int>& sample,
+                                 const std::vector<float>& sample_weights,
+                                 float positive_weight, float negative_weight,
+                                 std::vector<float>* responses, std::vector<int>* order,
+                                 std::vector<unsigned int>* scratch,
+                                 float* split, float* sign, float* loss) const;
+
+  /**
+   * Best split of feature index over the examples in subset, using the
+   * binned responses.  The histogram is scratch space for 2 * num_bins_
+   * values.
+   */
+  void SelectFeatureHistogramSingle(int index, const std::vector<int>& subset,
+                                    const std::vector<float>& subset_weights,
+                                    const std::vector<char>& subset_positive,
+                                    float positive_weight, float negative_weight,
+                                    std::vector<float>* histogram,
+                                    float* split, float* sign, float* loss) const;
+
+  /**
+   * Quantize each feature's responses into bins holding roughly equal
+   * numbers of examples, for SelectFeatureSubset.
+   */
+  void BuildBins();
+
+  /**
+   * Forget the cached losses used by SelectFeatureLazy.
+   */
+  void ResetLazyState();
+
+  // Loss of each feature when it was last evaluated, along with the
+  // accumulated weight change at that time.
+  std::vector<float> cached_losses_;
+  std::vector<double> cached_log_scales_;
+  std::vector<double> cached_decreases_;
+
+  // Weights from the previous call to SelectFeatureLazy, and the
+  // accumulated weight change since the cache was reset: the log of the
+  // smallest per-example scaling, and the total weight decrease.
+  std::vector<float> last_weights_;
+  double total_log_scale_;
+  double total_decrease_;
+
+  // Mask of the active examples, and their sorted orders, one block of
+  // num_active_ per feature.  Empty if all the examples are active.
+  std::vector<char> active_;
+  std::vector<int> active_sorted_;
+  int num_active_;
+
+  // Bin of each example for each feature, feature-major, and the split
+  // above each bin.  Built on first use and cleared when the examples change.
+  std::vector<unsigned char> bins_;
+  std::vector<float> bin_splits_;
+  int num_bins_;
 };
 
+/**
+ * Weight trimming.  Returns the examples left after dropping the ones
+ * with the smallest weights, as long as the dropped weight is at most
+ * tail_mass of the total.  The examples are returned in order.
+ */
+void TrimWeights(const std::vector<float>& weights, float tail_mass, std::vector<int>* active);
+
+/**
+ * Gradient-based one-side sampling.  Keeps the top_fraction of examples
+ * with the largest weights, plus a random other_fraction of the rest
+ * scaled up so the weight of the rest stays unbiased.  The subset is
+ * returned in example order.
+ */
+void GossSample(const std::vector<float>& weights, float top_fraction, float other_fraction,
+                std::vector<int>* subset, std::vector<float>* subset_weights);
+
 }  // namespace speedboost
 
 #endif  // ifndef SPEEDBOOST_FEATURE_SELECTOR_H
@@ -0,0 +1,142 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "data_source.h"
+#include "frame_set.h"
+#include "util.h"
+
+using namespace std;
+
+namespace speedboost {
+
+FrameSet::FrameSet()
+  : labels_(), levels_(), positives_(), num_windows_(0), max_overlap_(0.0) {
+}
+
+bool FrameSet::Load(const vector<string>& filenames, float initial_scale,
+                    int num_scales, float scaling_factor, float max_overlap) {
+  labels_.clear();
+  levels_.clear();
+  positives_.clear();
+  num_windows_ = 0;
+  max_overlap_ = max_overlap;
+
+  int pw = FLAGS_patch_width;
+  int ph = FLAGS_patch_height;
+
+  for (unsigned int f = 0; f < filenames.size(); f++) {
+    vector<Patch> frames;
+    vector< vector<Label> > labels;
+    DataSource::ReadLabeledPatchesFromFile(filenames[f], INT_MAX, &frames, &labels);
+
+    for (unsigned int i = 0; i < frames.size(); i++) {
+      const Patch& frame = frames[i];
+      int frame_index = labels_.size();
+      labels_.push_back(labels[i]);
+
+      for (unsigned int j = 0; j < labels[i].size(); j++) {
+        positives_.emplace_back(1, pw, ph, frame.channels());
+        frame.ExtractLabel(labels[i][j], &positives_.back());
+        positives_.back().ComputeIntegralImage();
+        positives_.back().set_id(positives_.size() - 1);
+      }
+
+      float scale = 1.0 / initial_scale;
+      for (int s = 0; s < num_scales; s++) {
+        int scaled_width = frame.width() * scale;
+        int scaled_height = frame.height() * scale;
+        if (scaled_width < pw || scaled_height < ph)
+          break;
+
+        levels_.push_back(Level());
+        Level& level = levels_.back();
+        level.frame = frame_index;
+        level.scale = scale;
+        level.integral = Patch(0, scaled_width, scaled_height, frame.channels());
+        frame.ExtractLabel(Label(0, 0, frame.width(), frame.height()), &level.integral);
+        level.integral.ComputeIntegralImage();
+        level.first = num_windows_;
+        level.windows_x = scaled_width - pw + 1;
+        level.windows_y = scaled_height - ph + 1;
+        num_windows_ += (int64_t)level.windows_x * level.windows_y;
+
+        scale = scale / scaling_factor;
+      }
+    }
+  }
+
+  cout << "Loaded " << labels_.size() << " frames with " << positives_.size() << " labels, "
+       << levels_.size() << " pyramid levels and " << num_windows_ << " windows." << endl;
+  return !labels_.empty();
+}
+
+bool FrameSet::OverlapsLabel(const Level& level, int x, int y) const {
+  // The window in the coordinates of the original frame.
+  float x0 = x / level.scale;
+  float y0 = y / level.scale;
+  float x1 = x0 + FLAGS_patch_width / level.scale;
+  float y1 = y0 + FLAGS_patch_height / level.scale;
+
+  const vector<Label>& labels = labels_[level.frame];
+  for (unsigned int j = 0; j < labels.size(); j++) {
+    const Label& l = labels[j];
+    float iw = min(x1, (float)(l.x() + l.w())) - max(x0, (float)l.x());
+    float ih = min(y1, (float)(l.y() + l.h())) - max(y0, (float)l.y());
+    if (iw <= 0 || ih <= 0)
+      continue;
+
+    float intersection = iw * ih;
+    float area = (x1 - x0) * (y1 - y0) + (float)l.w() * l.h() - intersection;
+    if (intersection > max_overlap_ * area)
+      return true;
+  }
+
+  return false;
+}
+
+bool FrameSet::Window(int64_t i, Patch* p) const {
+  assert(i >= 0 && i < num_windows_);
+
+  // Last level starting at or before window i.
+  int lo = 0;
+  int hi = levels_.size() - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (levels_[mid].first <= i) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  const Level& level = levels_[lo];
+  int64_t k = i - level.first;
+  int ax = k % level.windows_x;
+  int ay = k / level.windows_x;
+  if (OverlapsLabel(level, ax, ay))
+    return false;
+
+  level.integral.CutIntegralWindow(ax, ay, FLAGS_patch_width, FLAGS_patch_height, p);
+  p->set_id(i);
+  return true;
+}
+
+bool FrameSet::RandomWindow(Patch* p) const {
+  if (num_windows_ == 0)
+    return false;
+
+  return Window(RandomIndex(num_windows_), p);
+}
+
+}  // namespace speedboost
@@ -0,0 +1,84 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_FRAME_SET_H
+#define SPEEDBOOST_FRAME_SET_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "patch.h"
+
+namespace speedboost {
+
+/**
+ * Training windows from full labeled frames (see
+ * DataSource::WriteLabeledPatchesToFile), for frames mode.
+ *
+ * Each frame's scaled integral image pyramid is computed once on
+ * Load, with the same scales as Detector.  Every patch sized window of
+ * every level is a candidate negative unless it overlaps a label, and
+ * is numbered so windows can be drawn uniformly at random or cached by
+ * index.  A window is cut straight out of its level's integral image
+ * (by differences of the integral at its corners), so no frame data is
+ * resampled or integrated per window, and the features see the same
+ * values the detector would.  The labels themselves are extracted once
+ * as the positives.
+ */
+class FrameSet {
+public:
+  FrameSet();
+
+  /**
+   * Read the frames and labels in filenames and build their pyramids.
+   * Level i is scaled by 1 / (initial_scale * scaling_factor^i).
+   * Windows with an intersection over union above max_overlap with
+   * any label are not used as negatives.  Returns false if no frames
+   * could be read.
+   */
+  bool Load(const std::vector<std::string>& filenames, float initial_scale,
+            int num_scales, float scaling_factor, float max_overlap);
+
+  /**
+   * Cut window i, 0 <= i < num_windows(), out of the pyramid as an
+   * integral image with label 0 and id i.  Returns false (and leaves p
+   * unchanged) if the window overlaps a label.
+   */
+  bool Window(int64_t i, Patch* p) const;
+  bool RandomWindow(Patch* p) const;
+
+  inline const std::vector<Patch>& positives() const { return positives_; }
+  inline int num_frames() const { return labels_.size(); }
+  inline int num_levels() const { return levels_.size(); }
+  inline int64_t num_windows() const { return num_windows_; }
+
+private:
+  /**
+   * One level of a frame's pyramid.
+   */
+  struct Level {
+    int frame;
+    float scale;
+    Patch integral;
+    // Number of the first window, and windows per row and column.
+    int64_t first;
+    int windows_x;
+    int windows_y;
+  };
+
+  bool OverlapsLabel(const Level& level, int x, int y) const;
+
+  std::vector< std::vector<Label> > labels_;
+  std::vector<Level> levels_;
+  std::vector<Patch> positives_;
+  int64_t num_windows_;
+  float max_overlap_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_FRAME_SET_H
@@ -4,15 +4,24 @@
 // @author Alex Grubb (agrubb@cmu.edu)
 //
 
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
 #include <iostream>
 #include <fstream>
 #include <gflags/gflags.h>
 #include <ImageMagick/Magick++.h>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
-#include "data_source.h"
+#include "bounded_queue.h"
 #include "image_util.h"
 #include "patch.h"
 
@@ -28,12 +37,67 @@ DEFINE_int32(label, 0,
 DEFINE_bool(extract_patches, true,
 	    "If true, extract the labeled patches.  If false, simply store"
 	    "images and labels for later extraction.");
+DEFINE_bool(store_integral, false,
+	    "If true, store the integral images of extracted patches, so they "
+	    "don't need to be recomputed every time the patches are read.");
 DEFINE_bool(output_images, false,
 	    "If output_frames is true, write all the loaded images to output_images_directory.");
 DEFINE_string(output_images_directory, "",
 	      "If output_frames is true, write images as [output_frames_directory]/[index].ppm.");
+DEFINE_int32(load_threads, 0,
+             "Number of threads decoding images and extracting patches.  "
+             "0 uses one per core.");
+DEFINE_int32(load_queue_size, 16,
+             "Max number of decoded images held in memory at once, waiting "
+             "to be written in order (and, with several output shards, for "
+             "each shard's writer).");
+DEFINE_int32(num_output_shards, 1,
+             "Number of files to deal the output out to round robin, each "
+             "written by its own thread.  If more than one, the files are "
+             "named [output_filename]-[shard]-of-[num_output_shards] and listed "
+             "in [output_filename].manifest, and can be read back with a glob "
+             "like [output_filename]-*.");
 
-bool ParseLabelsAndPatches(string filename, vector<Patch>* patches, vector< vector<Label> >* labels) {
+/**
+ * An image listed in the label file, with its labels.
+ */
+struct LabeledImage {
+  string filename;
+  vector<Label> labels;
+};
+
+/**
+ * A decoded image, with the patches extracted from it (or the whole
+ * frame if --extract_patches is false), on its way to the writer.
+ */
+struct LoadedImage {
+  int index;
+  bool loaded;
+  vector<Patch> patches;
+  vector<Label> labels;
+};
+
+/**
+ * State shared between the decoding threads and the writer.  Images
+ * are handed out in order, but no further than --load_queue_size
+ * ahead of the writer, so at most that many decoded images are ever
+ * held in memory no matter how long the label file is.
+ */
+struct LoadPipeline {
+  explicit LoadPipeline(int queue_size)
+    : next_image(0), num_written(0), queue_size(queue_size), results(queue_size) {
+  }
+
+  int next_image;
+  int num_written;
+  int queue_size;
+  mutex lock;
+  condition_variable written;
+
+  BoundedQueue<LoadedImage> results;
+};
+
+bool ParseLabels(string filename, vector<LabeledImage>* images) {
   ifstream file(filename.c_str());
   if ( !file.is_open() )
     return false;
@@ -47,47 +111,254 @@ bool ParseLabelsAndPatches(string filename, vector<Patch>* patches, vector< vect
     if (str.empty()) break;
     if (str.at(0) == '#' ) continue; /* comment */
 
-    // cout << dirname + str << endl;
-
-    Magick::Image frame(dirname + str);
-    if (FLAGS_patch_depth == 3) {
-      frame.type(Magick::TrueColorType);
-    } else {
-      frame.type(Magick::GrayscaleType);
-    }
-
-    Patch p(FLAGS_label, frame.columns(), frame.rows(), FLAGS_patch_depth);
-    ImageToPatch(frame, &p);
-    patches->push_back(p);
+    images->push_back(LabeledImage());
+    images->back().filename = dirname + str;
 
     int num_labels = 0;
     file >> num_labels;
-    vector<Label> patch_labels;
     for (int i = 0; i < num_labels; i++) {
       int x, y, w, h;
       file >> x >> y >> w >> h;
-      // cout << "Label @ (" << x << ", " << y << ") " << w << "x" << h << endl;
-      
-      patch_labels.push_back(Label(x, y, w, h, 1));
+      images->back().labels.push_back(Label(x, y, w, h, 1));
     }
-    labels->push_back(patch_labels);
   }
   file.close();
 
   return true;
 }
 
-bool OutputImages(string filename, const vector<Patch>& patches) {
-  for (unsigned int i = 0; i < patches.size(); i++) {
-    size_t pos = filename.rfind('/');
-    string dirname = pos == string::npos ? filename : filename.substr(0, pos);
+/**
+ * Decode image (and extract its patches) into loaded.
+ */
+void LoadImage(const LabeledImage& image, LoadedImage* loaded) {
+  Patch frame;
+  try {
+    Magick::Image magick_frame(image.filename);
+    if (FLAGS_patch_depth == 3) {
+      magick_frame.type(Magick::TrueColorType);
+    } else {
+      magick_frame.type(Magick::GrayscaleType);
+    }
+
+    frame = Patch(FLAGS_label, magick_frame.columns(), magick_frame.rows(), FLAGS_patch_depth);
+    ImageToPatch(magick_frame, &frame);
+  } catch (const std::exception& e) {
+    cout << "WARNING: unable to load " << image.filename << ", skipping it: " << e.what() << endl;
+    loaded->loaded = false;
+    return;
+  }
+  loaded->loaded = true;
+
+  if (FLAGS_extract_patches) {
+    loaded->patches.reserve(image.labels.size());
+    for (unsigned int j = 0; j < image.labels.size(); j++) {
+      loaded->patches.emplace_back(FLAGS_label, FLAGS_patch_width, FLAGS_patch_height, FLAGS_patch_depth);
+      frame.ExtractLabel(image.labels[j], &loaded->patches.back());
+    }
+  } else {
+    loaded->patches.push_back(std::move(frame));
+    loaded->labels = image.labels;
+  }
+}
+
+void DecodeThread(const vector<LabeledImage>* images, LoadPipeline* pipeline) {
+  while (true) {
+    int index;
+    {
+      unique_lock<mutex> lock(pipeline->lock);
+      while (pipeline->next_image < (int)(images->size()) &&
+             pipeline->next_image >= pipeline->num_written + pipeline->queue_size) {
+        pipeline->written.wait(lock);
+      }
+      if (pipeline->next_image >= (int)(images->size()))
+        return;
+      index = pipeline->next_image++;
+    }
+
+    LoadedImage loaded;
+    loaded.index = index;
+    LoadImage((*images)[index], &loaded);
+
+    if (!pipeline->results.Push(std::move(loaded)))
+      return;
+  }
+}
+
+/**
+ * Write the patches of one image to --output_images_directory, numbering
+ * them from num_images_output.
+ */
+void OutputImages(const LoadedImage& loaded, int* num_images_output) {
+  size_t pos = FLAGS_output_images_directory.rfind('/');
+  string dirname = pos == string::npos ? FLAGS_output_images_directory :
+    FLAGS_output_images_directory.substr(0, pos);
+  for (unsigned int i = 0; i < loaded.patches.size(); i++) {
     stringstream ss;
-    ss << dirname << "/" << i << ".ppm";
-    string filename = ss.str();
-    patches[i].WritePPM(filename);
+    ss << dirname << "/" << (*num_images_output)++ << ".ppm";
+    loaded.patches[i].WritePPM(ss.str());
   }
+}
 
-  return true;
+/**
+ * Write the patches (and labels) of one image.
+ */
+void WriteImage(const LoadedImage& loaded, ostream& out) {
+  for (unsigned int i = 0; i < loaded.patches.size(); i++) {
+    const Patch& p = loaded.patches[i];
+    if (FLAGS_extract_patches && FLAGS_store_integral) {
+      Patch integral(p);
+      integral.ComputeIntegralImage();
+      integral.Write(out);
+    } else {
+      p.Write(out);
+    }
+  }
+
+  if (!FLAGS_extract_patches) {
+    int num_labels = loaded.labels.size();
+    out.write((char*)(&num_labels), sizeof(int));
+    for (int j = 0; j < num_labels; j++) {
+      loaded.labels[j].Write(out);
+    }
+  }
+}
+
+/**
+ * One output file, serialized by its own thread from a queue of the
+ * records sent to it.
+ */
+struct OutputShard {
+  explicit OutputShard(int queue_size)
+    : filename(), out(), num_records(0), queue(queue_size), writer() {
+  }
+
+  string filename;
+  ofstream out;
+  int num_records;
+
+  BoundedQueue<LoadedImage> queue;
+  thread writer;
+};
+
+void ShardWriterThread(OutputShard* shard) {
+  LoadedImage loaded;
+  while (shard->queue.Pop(&loaded)) {
+    WriteImage(loaded, shard->out);
+  }
+}
+
+/**
+ * Name of shard s of n, e.g. patches-00002-of-00008, or just the
+ * output filename if there is only one.
+ */
+string ShardFilename(const string& filename, int s, int n) {
+  if (n == 1)
+    return filename;
+
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "-%05d-of-%05d", s, n);
+  return filename + suffix;
+}
+
+/**
+ * Send the records of an image to the shards, dealing them out round
+ * robin from *next_shard: each patch when extracting patches, or the
+ * frame and its labels as a whole otherwise.
+ */
+void SendImage(LoadedImage* loaded, const vector<OutputShard*>& shards, int* next_shard) {
+  int n = shards.size();
+  if (!FLAGS_extract_patches) {
+    OutputShard* shard = shards[*next_shard];
+    *next_shard = (*next_shard + 1) % n;
+    shard->num_records += loaded->patches.size();
+    shard->queue.Push(std::move(*loaded));
+    return;
+  }
+
+  vector<LoadedImage> parts(min(n, (int)(loaded->patches.size())));
+  int first = *next_shard;
+  for (unsigned int i = 0; i < loaded->patches.size(); i++) {
+    parts[i % parts.size()].patches.push_back(std::move(loaded->patches[i]));
+  }
+  for (unsigned int j = 0; j < parts.size(); j++) {
+    OutputShard* shard = shards[(first + j) % n];
+    shard->num_records += parts[j].patches.size();
+    shard->queue.Push(std::move(parts[j]));
+  }
+  *next_shard = (first + loaded->patches.size()) % n;
+}
+
+/**
+ * Decode the images on --load_threads threads, and send them in the
+ * order of the label file as they finish to the shards to be written.
+ * Returns the number of images loaded.
+ */
+int LoadImages(const vector<LabeledImage>& images, const vector<OutputShard*>& shards) {
+  int num_threads = FLAGS_load_threads;
+  if (num_threads <= 0) {
+    num_threads = max((int)thread::hardware_concurrency(), 1);
+  }
+
+  LoadPipeline pipeline(max(FLAGS_load_queue_size, 1));
+  vector<thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.push_back(thread(DecodeThread, &images, &pipeline));
+  }
+
+  // Images finishing ahead of their turn wait here for the ones before them.
+  map<int, LoadedImage> pending;
+  int num_loaded = 0;
+  int num_images_output = 0;
+  int next_shard = 0;
+  for (int i = 0; i < (int)(images.size()); i++) {
+    map<int, LoadedImage>::iterator next;
+    while ((next = pending.find(i)) == pending.end()) {
+      LoadedImage loaded;
+      if (!pipeline.results.Pop(&loaded))
+        break;
+      int index = loaded.index;
+      pending.insert(make_pair(index, std::move(loaded)));
+    }
+    assert(next != pending.end());
+
+    if (next->second.loaded) {
+      if (FLAGS_output_images) {
+        OutputImages(next->second, &num_images_output);
+      }
+      SendImage(&next->second, shards, &next_shard);
+      num_loaded++;
+    }
+    pending.erase(next);
+
+    {
+      lock_guard<mutex> lock(pipeline.lock);
+      pipeline.num_written++;
+    }
+    pipeline.written.notify_all();
+  }
+
+  pipeline.results.Close();
+  for (unsigned int t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+  return num_loaded;
+}
+
+/**
+ * List every shard and the number of records in it, one per line.
+ */
+bool WriteManifest(const string& filename, const vector<OutputShard*>& shards) {
+  ofstream out(filename.c_str(), ofstream::out | ofstream::trunc);
+  if (!out.is_open())
+    return false;
+
+  out << "# " << shards.size() << " shards, filename and number of "
+      << (FLAGS_extract_patches ? "patches" : "frames") << " in each" << endl;
+  for (unsigned int s = 0; s < shards.size(); s++) {
+    out << shards[s]->filename << " " << shards[s]->num_records << endl;
+  }
+  out.close();
+  return !out.fail();
 }
 
 int main(int argc, char *argv[])
@@ -112,30 +383,71 @@ int main(int argc, char *argv[])
      return 1;
   }
 
-  vector<Patch> frames;
-  vector< vector<Label> > labels;
-  ParseLabelsAndPatches(FLAGS_label_filename, &frames, &labels);
+  if (FLAGS_num_output_shards < 1) {
+    cout << "Number of output shards must be at least 1, exiting." << endl;
+    return 1;
+  }
 
-  if (FLAGS_extract_patches) {
-    vector<Patch> patches;
-    for (unsigned int i = 0; i < frames.size(); i++) {
-      for (unsigned int j = 0; j < labels[i].size(); j++) {
-	Patch p(FLAGS_label, FLAGS_patch_width, FLAGS_patch_height, FLAGS_patch_depth);
-	frames[i].ExtractLabel(labels[i][j], &p);
-	patches.push_back(p);
-      }
+  vector<LabeledImage> images;
+  if (!ParseLabels(FLAGS_label_filename, &images)) {
+    cout << "Unable to read " << FLAGS_label_filename << ", exiting." << endl;
+    return 1;
+  }
+
+  // Open every output file before starting any writers, so there is
+  // nothing to stop if one of them can't be opened.
+  vector<OutputShard*> shards;
+  bool opened = true;
+  for (int s = 0; s < FLAGS_num_output_shards && opened; s++) {
+    shards.push_back(new OutputShard(max(FLAGS_load_queue_size, 1)));
+    shards.back()->filename = ShardFilename(FLAGS_output_filename, s, FLAGS_num_output_shards);
+    shards.back()->out.open(shards.back()->filename.c_str(), ofstream::out);
+    if (!shards.back()->out.is_open()) {
+      cout << "ERROR: unable to open " << shards.back()->filename << " for writing." << endl;
+      opened = false;
     }
+  }
 
-    DataSource::WritePatchesToFile(FLAGS_output_filename, patches);
-    if (FLAGS_output_images) {
-      OutputImages(FLAGS_output_images_directory, patches);
+  if (!opened) {
+    for (unsigned int s = 0; s < shards.size(); s++) {
+      delete shards[s];
     }
-  } else {
-    DataSource::WriteLabeledPatchesToFile(FLAGS_output_filename, frames, labels);
-    if (FLAGS_output_images) {
-      OutputImages(FLAGS_output_images_directory, frames);
+    return 1;
+  }
+
+  for (unsigned int s = 0; s < shards.size(); s++) {
+    shards[s]->writer = thread(ShardWriterThread, shards[s]);
+  }
+
+  int num_loaded = LoadImages(images, shards);
+
+  bool failed = false;
+  for (unsigned int s = 0; s < shards.size(); s++) {
+    shards[s]->queue.Close();
+    shards[s]->writer.join();
+    shards[s]->out.close();
+    if (shards[s]->out.fail()) {
+      cout << "ERROR: failed writing " << shards[s]->filename << endl;
+      failed = true;
     }
   }
 
-  return 0;
+  if (shards.size() > 1) {
+    string manifest = FLAGS_output_filename + ".manifest";
+    if (!WriteManifest(manifest, shards)) {
+      cout << "ERROR: unable to write " << manifest << endl;
+      failed = true;
+    }
+  }
+
+  for (unsigned int s = 0; s < shards.size(); s++) {
+    delete shards[s];
+  }
+
+  cout << "Loaded " << num_loaded << " of " << images.size() << " images";
+  if (FLAGS_num_output_shards > 1) {
+    cout << " into " << FLAGS_num_output_shards << " shards";
+  }
+  cout << "." << endl;
+  return failed ? 1 : 0;
 }
@@ -71,10 +71,13 @@ void Patch::ComputeIntegralImage() {
       }
     }
   }
+
+  integral_ = true;
 }
 
   void Patch::ExtractLabel(const Label& l, Patch* p, bool nearest) const {
   assert(channels() == p->channels());
+  p->integral_ = false;
   
   if ((l.w() == p->width()) && (l.h() == p->height())) {
     for (int x = 0; x < p->width(); x++) {
@@ -96,6 +99,26 @@ void Patch::ComputeIntegralImage() {
   }
 }
 
+void Patch::CutIntegralWindow(int ax, int ay, int w, int h, Patch* p) const {
+  assert(integral_);
+  assert(ax >= 0 && ay >= 0 && ax + w <= width_ && ay + h <= height_);
+
+  // I(x, y) = L(ax + x, ay + y) - L(ax - 1, ay + y) - L(ax + x, ay - 1) + L(ax - 1, ay - 1)
+  p->Reset(0, w, h, channels_);
+  for (int c = 0; c < channels_; c++) {
+    float corner = (ax > 0 && ay > 0) ? Value(ax - 1, ay - 1, c) : 0.0;
+    for (int y = 0; y < h; y++) {
+      float left = (ax > 0) ? Value(ax - 1, ay + y, c) : 0.0;
+      for (int x = 0; x < w; x++) {
+        float top = (ay > 0) ? Value(ax + x, ay - 1, c) : 0.0;
+        p->SetValue(x, y, c, Value(ax + x, ay + y, c) - left - top + corner);
+      }
+    }
+  }
+
+  p->integral_ = true;
+}
+
 void Patch::ExtractLabelArea(const Label& l, Patch* p) const {
   int lw = l.w();
   int lh = l.h();
@@ -106,15 +129,11 @@ void Patch::ExtractLabelArea(const Label& l, Patch* p) const {
   float xscale = float(lw)/float(pw);
   float yscale = float(lh)/float(ph);
 
-  // Squash the x dimension in to a pw x lh temporary patch.
-  Patch buf(0, pw, lh, channels());
-  for (int x = 0; x < pw; x++) {
-    for (int y = 0; y < lh; y++) {
-      for (int c = 0; c < channels(); c++) {
-	buf.SetValue(x, y, c, 0.0);
-      }
-    }
-  }
+  // Squash the x dimension in to a pw x lh temporary patch.  Each
+  // thread keeps its own buffer, so repeated extractions (e.g. every
+  // window of a frame) don't allocate.
+  static thread_local Patch buf;
+  buf.Reset(0, pw, lh, channels());
 
   float rem = 0.0;
   int px = 0;
@@ -259,16 +278,23 @@ void Patch::ExtractLabelNearest(const Label& l, Patch* p) const {
 
 void Patch::GenerateAllPatches(int width, int height, int step,
                                vector<Label>* labels, vector<Patch>* patches) const {
+  int num_rows = (this->height() - height + step - 1) / step;
+  int num_columns = (this->width() - width + step - 1) / step;
+  if (num_rows > 0 && num_columns > 0) {
+    labels->reserve(labels->size() + num_rows * num_columns);
+    patches->reserve(patches->size() + num_rows * num_columns);
+  }
+
   for (int h = 0; h < this->height() - height; h += step) {
     for (int w = 0; w < this->width() - width; w += step) {
       Label l(w, h, width, height);
 
-      Patch p(0, FLAGS_patch_width, FLAGS_patch_height, this->channels());
-      ExtractLabel(l, &p);
-      p.ComputeIntegralImage();
+      // Extract straight into the new element instead of copying it in.
+      patches->emplace_back(0, FLAGS_patch_width, FLAGS_patch_height, this->channels());
+      ExtractLabel(l, &patches->back());
+      patches->back().ComputeIntegralImage();
 
       labels->push_back(l);
-      patches->push_back(p);
     }
   }
 }
@@ -278,6 +304,8 @@ bool Patch::FromMessage(const PatchMessage& msg) {
   height_ = msg.height();
   channels_ = msg.depth();
   label_ = msg.label();
+  integral_ = msg.integral();
+  id_ = -1;
 
   if (msg.data_size() != width_ * height_ * channels_)
     return false;
@@ -293,6 +321,9 @@ void Patch::ToMessage(PatchMessage* msg) const {
   msg->set_height(height_);
   msg->set_depth(channels_);
   msg->set_label(label_);
+  if (integral_) {
+    msg->set_integral(true);
+  }
 
   for (int i = 0; i < (int)(data_.size()); i++) {
     msg->add_data(data_[i]);
@@ -11,7 +11,9 @@
 #include <gflags/gflags.h>
 #include <iostream>
 #include <fstream>
+#include <stdint.h>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "patch.pb.h"
@@ -73,22 +75,30 @@ class Patch {
 public:
   Patch()
     : label_(0), width_(0), height_(0), channels_(0),
-      data_() {
+      integral_(false), id_(-1), data_() {
   }
 
   Patch(char label, int w, int h, int c)
     : label_(label), width_(w), height_(h), channels_(c),
-      data_(w*h*c, 0) {
+      integral_(false), id_(-1), data_(w*h*c, 0) {
   }
 
-  Patch(const Patch& other) {
-    label_ = other.label_;
-
-    width_ = other.width_;
-    height_ = other.height_;
-    channels_ = other.channels_;
+  Patch(const Patch& other)
+    : label_(other.label_), width_(other.width_), height_(other.height_),
+      channels_(other.channels_), integral_(other.integral_), id_(other.id_),
+      data_(other.data_) {
+  }
 
-    data_ = other.data_;
+  /**
+   * Take over the pixels of other without copying, leaving it empty.
+   */
+  Patch(Patch&& other) noexcept
+    : label_(other.label_), width_(other.width_), height_(other.height_),
+      channels_(other.channels_), integral_(other.integral_), id_(other.id_),
+      data_(std::move(other.data_)) {
+    other.width_ = 0;
+    other.height_ = 0;
+    other.channels_ = 0;
   }
   
   bool operator==(const Patch& other) const {
@@ -101,11 +111,44 @@ public:
     width_ = other.width_;
     height_ = other.height_;
     channels_ = other.channels_;
+    integral_ = other.integral_;
+    id_ = other.id_;
 
     data_ = other.data_;
     return *this;
   }
 
+  Patch& operator=(Patch&& other) noexcept {
+    label_ = other.label_;
+
+    width_ = other.width_;
+    height_ = other.height_;
+    channels_ = other.channels_;
+    integral_ = other.integral_;
+    id_ = other.id_;
+
+    data_.swap(other.data_);
+    other.width_ = 0;
+    other.height_ = 0;
+    other.channels_ = 0;
+    other.data_.clear();
+    return *this;
+  }
+
+  /**
+   * Resize to w x h x c and zero the pixels, reusing the existing
+   * allocation when it is large enough.
+   */
+  void Reset(char label, int w, int h, int c) {
+    label_ = label;
+    width_ = w;
+    height_ = h;
+    channels_ = c;
+    integral_ = false;
+    id_ = -1;
+    data_.assign(w*h*c, 0);
+  }
+
   inline void SetValue(int w, int h, int c, float v) {
     assert((c * width_ * height_ + h * width_ + w) < (int)(data_.size()));
     assert((c * width_ * height_ + h * width_ + w) >= 0);
@@ -121,6 +164,12 @@ public:
    */
   void ComputeIntegralImage();
 
+  /**
+   * True if the data is already an integral image, e.g. one computed
+   * by ComputeIntegralImage or read from a file storing integral images.
+   */
+  inline bool is_integral() const { return integral_; }
+
   /**
    * Extract the rectangle given in label and store the data
    * in patch.  If the size of patch and label are different,
@@ -132,6 +181,14 @@ public:
    */
   void ExtractLabel(const Label& label, Patch* patch, bool nearest=false) const;
 
+  /**
+   * Cut the w x h window with upper left corner (x, y) out of this
+   * integral image, as an integral image of its own, by differences of
+   * the integral at the window's corners.  Box features evaluate the
+   * same on the window as on this image at (x, y).
+   */
+  void CutIntegralWindow(int x, int y, int w, int h, Patch* window) const;
+
   /**
    * Extract every patch of size [width x height], with step pixels between
    * each adjacent patch.
@@ -159,6 +216,14 @@ public:
 
   inline void set_label(char label) { label_ = label; }
 
+  /**
+   * Identifies the record the patch was read from, so results for it
+   * can be cached across passes over the data (see ActivationCache).
+   * -1 if the patch doesn't come from a known record.
+   */
+  inline int64_t id() const { return id_; }
+  inline void set_id(int64_t id) { id_ = id; }
+
   inline char label() const { return label_; }
   inline int width() const { return width_; }
   inline int height() const { return height_; }
@@ -167,6 +232,9 @@ public:
   friend class SingleScaleDetector;
   friend class Detector;
   friend class Feature;
+  friend class PatchBatch;
+  friend class PatchFile;
+  friend class ProtoPatchFile;
 
 protected:
   void ExtractLabelArea(const Label& label, Patch* patch) const;
@@ -175,6 +243,8 @@ protected:
 
   char label_;
   int width_, height_, channels_;
+  bool integral_;
+  int64_t id_;
   std::vector<float> data_;
 };
 
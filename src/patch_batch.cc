@@ -0,0 +1,168 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "patch_batch.h"
+
+using namespace std;
+
+namespace speedboost {
+
+// Rows are padded to a multiple of this many floats (64 bytes).
+static const int kAlignment = 16;
+
+static size_t Align(size_t n) {
+  return (n + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+PatchBatch::PatchBatch()
+  : layout_(kPatchMajor), width_(0), height_(0), channels_(0),
+    num_patches_(0), capacity_(0), stride_(0), data_(NULL), labels_() {
+}
+
+PatchBatch::PatchBatch(Layout layout)
+  : layout_(layout), width_(0), height_(0), channels_(0),
+    num_patches_(0), capacity_(0), stride_(0), data_(NULL), labels_() {
+}
+
+PatchBatch::~PatchBatch() {
+  free(data_);
+}
+
+void PatchBatch::Append(const Patch& p) {
+  if (num_patches_ == 0 && pixels() == 0) {
+    SetSize(p, capacity_);
+  }
+
+  if (num_patches_ == capacity_) {
+    Reallocate(max(kAlignment, 2 * capacity_), layout_);
+  }
+
+  num_patches_++;
+  labels_.push_back(p.label());
+  Set(num_patches_ - 1, p);
+}
+
+void PatchBatch::Append(const vector<Patch>& patches) {
+  if (patches.empty())
+    return;
+
+  if (num_patches_ == 0 && pixels() == 0) {
+    SetSize(patches[0], max(capacity_, (int)patches.size()));
+  } else {
+    Reserve(num_patches_ + patches.size());
+  }
+
+  for (unsigned int p = 0; p < patches.size(); p++) {
+    Append(patches[p]);
+  }
+}
+
+void PatchBatch::Set(int i, const Patch& p) {
+  assert(i >= 0 && i < num_patches_);
+  assert(p.width() == width_ && p.height() == height_ && p.channels() == channels_);
+
+  labels_[i] = p.label();
+
+  int num_pixels = pixels();
+  if (layout_ == kPatchMajor) {
+    memcpy(data_ + (size_t)i * stride_, &p.data_[0], num_pixels * sizeof(float));
+  } else {
+    for (int k = 0; k < num_pixels; k++) {
+      data_[(size_t)k * stride_ + i] = p.data_[k];
+    }
+  }
+}
+
+void PatchBatch::Get(int i, Patch* p) const {
+  assert(i >= 0 && i < num_patches_);
+
+  *p = Patch(labels_[i], width_, height_, channels_);
+
+  int num_pixels = pixels();
+  if (layout_ == kPatchMajor) {
+    memcpy(&p->data_[0], data_ + (size_t)i * stride_, num_pixels * sizeof(float));
+  } else {
+    for (int k = 0; k < num_pixels; k++) {
+      p->data_[k] = data_[(size_t)k * stride_ + i];
+    }
+  }
+}
+
+void PatchBatch::Reserve(int num_patches) {
+  if (num_patches > capacity_) {
+    Reallocate(num_patches, layout_);
+  }
+}
+
+void PatchBatch::SetLayout(Layout layout) {
+  if (layout != layout_) {
+    Reallocate(capacity_, layout);
+  }
+}
+
+void PatchBatch::Clear() {
+  free(data_);
+
+  width_ = 0;
+  height_ = 0;
+  channels_ = 0;
+  num_patches_ = 0;
+  capacity_ = 0;
+  stride_ = 0;
+  data_ = NULL;
+  labels_.clear();
+}
+
+void PatchBatch::SetSize(const Patch& p, int capacity) {
+  width_ = p.width();
+  height_ = p.height();
+  channels_ = p.channels();
+
+  // Space reserved before the size was known holds no pixels yet.
+  Reallocate(capacity, layout_);
+}
+
+void PatchBatch::Reallocate(int capacity, Layout layout) {
+  int num_pixels = pixels();
+
+  size_t stride = (layout == kPatchMajor) ? Align(num_pixels) : Align(capacity);
+  size_t size = (layout == kPatchMajor) ? (size_t)capacity * stride : (size_t)num_pixels * stride;
+
+  float* data = NULL;
+  if (size > 0) {
+    void* memory;
+    if (posix_memalign(&memory, kAlignment * sizeof(float), size * sizeof(float)) != 0) {
+      throw bad_alloc();
+    }
+    data = (float*)memory;
+  }
+
+  // Copy over the existing patches, transposing if the layout changed.
+  for (int i = 0; i < num_patches_; i++) {
+    for (int k = 0; k < num_pixels; k++) {
+      float v = (layout_ == kPatchMajor) ? data_[(size_t)i * stride_ + k] : data_[(size_t)k * stride_ + i];
+      if (layout == kPatchMajor) {
+        data[(size_t)i * stride + k] = v;
+      } else {
+        data[(size_t)k * stride + i] = v;
+      }
+    }
+  }
+
+  free(data_);
+
+  data_ = data;
+  stride_ = stride;
+  capacity_ = capacity;
+  layout_ = layout;
+}
+
+}  // namespace speedboost
@@ -0,0 +1,145 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_PATCH_BATCH_H
+#define SPEEDBOOST_PATCH_BATCH_H
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include "patch.h"
+
+namespace speedboost {
+
+/**
+ * A set of same-size patches stored in a single aligned buffer, instead
+ * of one heap allocation per Patch.
+ *
+ * In the patch-major layout each patch's pixels are contiguous, as in
+ * Patch.  In the pixel-major layout the data is transposed, so the value
+ * of one pixel across every patch is contiguous:
+ *
+ *   [ pixel(0) of patches 0..N | pixel(1) of patches 0..N | ... ]
+ *
+ * which turns evaluating a feature over all of the patches into
+ * contiguous (SIMD friendly) loads.  Rows are padded so every patch
+ * (patch-major) or pixel (pixel-major) starts on a 64 byte boundary.
+ */
+class PatchBatch {
+public:
+  enum Layout {
+    kPatchMajor,
+    kPixelMajor
+  };
+
+  PatchBatch();
+  explicit PatchBatch(Layout layout);
+  ~PatchBatch();
+
+  /**
+   * Add a patch to the end of the batch.  All patches must have the
+   * same size as the first one added.
+   */
+  void Append(const Patch& p);
+  void Append(const std::vector<Patch>& patches);
+
+  /**
+   * Overwrite patch i with p, which must be the same size.
+   */
+  void Set(int i, const Patch& p);
+
+  /**
+   * Copy patch i back out into a Patch.
+   */
+  void Get(int i, Patch* p) const;
+
+  /**
+   * Make room for num_patches patches without reallocating.
+   */
+  void Reserve(int num_patches);
+
+  /**
+   * Switch to the given layout, transposing the data if needed.
+   */
+  void SetLayout(Layout layout);
+
+  /**
+   * Remove all of the patches, keeping the layout.
+   */
+  void Clear();
+
+  inline float Value(int i, int w, int h, int c) const {
+    int k = c * width_ * height_ + h * width_ + w;
+    if (layout_ == kPatchMajor) {
+      return data_[(size_t)i * stride_ + k];
+    } else {
+      return data_[(size_t)k * stride_ + i];
+    }
+  }
+
+  /**
+   * Pixel (w, h, c) of every patch, for the pixel-major layout.
+   */
+  inline const float* Pixel(int w, int h, int c) const {
+    assert(layout_ == kPixelMajor);
+    return data_ + (size_t)(c * width_ * height_ + h * width_ + w) * stride_;
+  }
+
+  /**
+   * All of the pixels of patch i, for the patch-major layout.
+   */
+  inline const float* PatchData(int i) const {
+    assert(layout_ == kPatchMajor);
+    return data_ + (size_t)i * stride_;
+  }
+
+  inline char label(int i) const { return labels_[i]; }
+  inline void set_label(int i, char label) { labels_[i] = label; }
+  inline const std::vector<char>& labels() const { return labels_; }
+
+  inline int size() const { return num_patches_; }
+  inline bool empty() const { return num_patches_ == 0; }
+  inline int width() const { return width_; }
+  inline int height() const { return height_; }
+  inline int channels() const { return channels_; }
+  inline int pixels() const { return width_ * height_ * channels_; }
+  inline Layout layout() const { return layout_; }
+
+private:
+  // Not copyable, the buffer is owned by this object.
+  PatchBatch(const PatchBatch&);
+  PatchBatch& operator=(const PatchBatch&);
+
+  /**
+   * Take the patch size from p, for the first patch added.
+   */
+  void SetSize(const Patch& p, int capacity);
+
+  /**
+   * Reallocate the buffer for the given capacity and layout,
+   * keeping the existing patches.  Throws std::bad_alloc (leaving
+   * the batch unchanged) if the memory can't be allocated.
+   */
+  void Reallocate(int capacity, Layout layout);
+
+  Layout layout_;
+
+  int width_, height_, channels_;
+  int num_patches_;
+  int capacity_;
+
+  // Distance between the starts of consecutive patches (patch-major)
+  // or pixels (pixel-major), in floats.
+  size_t stride_;
+  float* data_;
+
+  std::vector<char> labels_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_PATCH_BATCH_H
@@ -0,0 +1,116 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "patch_dataset.h"
+#include "patch_file.h"
+#include "proto_patch_file.h"
+#include "util.h"
+
+using namespace std;
+
+namespace speedboost {
+
+PatchDataset::PatchDataset()
+  : files_(), size_(0) {
+}
+
+PatchDataset::~PatchDataset() {
+  Close();
+}
+
+bool PatchDataset::Open(const vector<string>& filenames) {
+  Close();
+
+  for (unsigned int f = 0; f < filenames.size(); f++) {
+    File file;
+    file.patch_file = NULL;
+    file.proto_file = NULL;
+    file.first = size_;
+
+    if (PatchFile::IsPatchFile(filenames[f])) {
+      file.patch_file = new PatchFile();
+      if (!file.patch_file->Open(filenames[f])) {
+        delete file.patch_file;
+        Close();
+        return false;
+      }
+      file.patch_file->AdviseRandomAccess();
+      file.size = file.patch_file->size();
+    } else {
+      file.proto_file = new ProtoPatchFile();
+      if (!file.proto_file->Open(filenames[f])) {
+        cout << "ERROR: unable to open " << filenames[f] << " for random access." << endl;
+        delete file.proto_file;
+        Close();
+        return false;
+      }
+
+      string index_filename = filenames[f] + ".index";
+      if (!file.proto_file->LoadIndex(index_filename)) {
+        file.proto_file->BuildIndex();
+        file.proto_file->SaveIndex(index_filename);
+      }
+      file.proto_file->AdviseRandomAccess();
+      file.size = file.proto_file->size();
+    }
+
+    files_.push_back(file);
+    size_ += file.size;
+  }
+
+  return true;
+}
+
+void PatchDataset::Close() {
+  for (unsigned int f = 0; f < files_.size(); f++) {
+    delete files_[f].patch_file;
+    delete files_[f].proto_file;
+  }
+
+  files_.clear();
+  size_ = 0;
+}
+
+bool PatchDataset::Read(size_t i, Patch* p) const {
+  assert(i < size_);
+
+  // Last file starting at or before i.
+  int lo = 0;
+  int hi = files_.size() - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (files_[mid].first <= i) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  const File& file = files_[lo];
+  if (file.patch_file) {
+    file.patch_file->Read(i - file.first, p);
+  } else if (!file.proto_file->Read(i - file.first, p)) {
+    return false;
+  }
+
+  p->set_id(i);
+  return true;
+}
+
+bool PatchDataset::ReadRandom(Patch* p) const {
+  if (size_ == 0)
+    return false;
+
+  return Read(RandomIndex(size_), p);
+}
+
+}  // namespace speedboost
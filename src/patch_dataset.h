@@ -0,0 +1,77 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_PATCH_DATASET_H
+#define SPEEDBOOST_PATCH_DATASET_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "patch.h"
+
+namespace speedboost {
+
+class PatchFile;
+class ProtoPatchFile;
+
+/**
+ * Random access to every patch in a set of files, numbered
+ * consecutively across the files.  Patch files (see PatchFile) are
+ * indexed by construction.  Protobuf patch files get an index of
+ * record offsets, which is loaded from a "<file>.index" sidecar if
+ * there is an up to date one, and otherwise built on open (and saved
+ * as a sidecar, if the directory is writable).
+ *
+ * Reads go straight to the mapped records, so drawing a patch only
+ * touches the pages holding that record.
+ */
+class PatchDataset {
+public:
+  PatchDataset();
+  ~PatchDataset();
+
+  /**
+   * Open and index all of filenames.  Returns false if any file
+   * can't be opened.
+   */
+  bool Open(const std::vector<std::string>& filenames);
+  void Close();
+
+  /**
+   * Read patch i, 0 <= i < size(), setting its id to i.  Returns
+   * false if the record is corrupt.  The patch is integrated only if
+   * the file stores integral images.
+   */
+  bool Read(size_t i, Patch* p) const;
+
+  /**
+   * Read a uniformly random patch.
+   */
+  bool ReadRandom(Patch* p) const;
+
+  inline size_t size() const { return size_; }
+  inline int num_files() const { return files_.size(); }
+
+private:
+  // Not copyable, owns the open files.
+  PatchDataset(const PatchDataset&);
+  PatchDataset& operator=(const PatchDataset&);
+
+  struct File {
+    PatchFile* patch_file;
+    ProtoPatchFile* proto_file;
+    size_t first;
+    size_t size;
+  };
+
+  std::vector<File> files_;
+  size_t size_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_PATCH_DATASET_H
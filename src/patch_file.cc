@@ -0,0 +1,240 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "patch_file.h"
+
+using namespace std;
+
+namespace speedboost {
+
+static const char kPatchFileMagic[4] = {'S', 'B', 'P', 'F'};
+static const uint32_t kPatchFileVersion = 1;
+
+static_assert(sizeof(PatchFileHeader) == 64, "patch file header should be 64 bytes");
+
+PatchFile::PatchFile()
+  : filename_(), header_(), data_(NULL), size_(0) {
+}
+
+PatchFile::~PatchFile() {
+  Close();
+}
+
+bool PatchFile::Open(const string& filename) {
+  Close();
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cout << "ERROR: unable to open patch file " << filename << endl;
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(PatchFileHeader)) {
+    cout << "ERROR: " << filename << " is too small to be a patch file." << endl;
+    close(fd);
+    return false;
+  }
+
+  void* data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    cout << "ERROR: unable to map patch file " << filename << endl;
+    return false;
+  }
+
+  memcpy(&header_, data, sizeof(PatchFileHeader));
+
+  size_t pixels = (size_t)header_.width * header_.height * header_.depth;
+  bool valid = (memcmp(header_.magic, kPatchFileMagic, 4) == 0) &&
+    (header_.version == kPatchFileVersion) &&
+    (header_.label_layout == kFileLabel || header_.label_layout == kRecordLabels) &&
+    ((header_.flags & ~kIntegral) == 0) &&
+    (header_.record_size == LabelBytes((LabelLayout)header_.label_layout, integral()) +
+     pixels * PixelBytes(integral())) &&
+    (sizeof(PatchFileHeader) + header_.count * header_.record_size <= (size_t)info.st_size);
+  if (!valid) {
+    cout << "ERROR: " << filename << " is not a valid patch file." << endl;
+    munmap(data, info.st_size);
+    memset(&header_, 0, sizeof(PatchFileHeader));
+    return false;
+  }
+
+  filename_ = filename;
+  data_ = (const unsigned char*)data;
+  size_ = info.st_size;
+  return true;
+}
+
+void PatchFile::Close() {
+  if (data_) {
+    munmap(const_cast<unsigned char*>(data_), size_);
+  }
+
+  filename_ = "";
+  memset(&header_, 0, sizeof(PatchFileHeader));
+  data_ = NULL;
+  size_ = 0;
+}
+
+void PatchFile::Read(size_t i, Patch* p) const {
+  assert(i < header_.count);
+
+  p->Reset(Label(i), header_.width, header_.height, header_.depth);
+
+  const unsigned char* record = Record(i) + LabelBytes((LabelLayout)header_.label_layout, integral());
+  int num_pixels = header_.width * header_.height * header_.depth;
+  float* data = &p->data_[0];
+  if (integral()) {
+    const uint32_t* sums = (const uint32_t*)record;
+    for (int k = 0; k < num_pixels; k++) {
+      data[k] = sums[k] * (1.0f / 255.0f);
+    }
+    p->integral_ = true;
+  } else {
+    for (int k = 0; k < num_pixels; k++) {
+      data[k] = record[k] * (1.0f / 255.0f);
+    }
+  }
+}
+
+void PatchFile::AdviseRandomAccess() const {
+  if (data_) {
+    madvise(const_cast<unsigned char*>(data_), size_, MADV_RANDOM);
+  }
+}
+
+size_t PatchFile::LabelBytes(LabelLayout label_layout, bool integral) {
+  if (label_layout == kFileLabel)
+    return 0;
+  return integral ? sizeof(uint32_t) : 1;
+}
+
+size_t PatchFile::PixelBytes(bool integral) {
+  return integral ? sizeof(uint32_t) : 1;
+}
+
+bool PatchFile::IsPatchFile(const string& filename) {
+  ifstream in(filename.c_str(), ifstream::in | ifstream::binary);
+  char magic[4];
+  in.read(magic, 4);
+
+  return in.good() && memcmp(magic, kPatchFileMagic, 4) == 0;
+}
+
+PatchFileWriter::PatchFileWriter()
+  : out_(), header_(), record_(), pixels_() {
+}
+
+PatchFileWriter::~PatchFileWriter() {
+  if (out_.is_open()) {
+    Close();
+  }
+}
+
+bool PatchFileWriter::Open(const string& filename, int width, int height, int depth,
+                           PatchFile::LabelLayout label_layout, int label, bool integral) {
+  memset(&header_, 0, sizeof(PatchFileHeader));
+  memcpy(header_.magic, kPatchFileMagic, 4);
+  header_.version = kPatchFileVersion;
+  header_.width = width;
+  header_.height = height;
+  header_.depth = depth;
+  header_.label_layout = label_layout;
+  header_.label = label;
+  header_.record_size = PatchFile::LabelBytes(label_layout, integral) +
+    width * height * depth * PatchFile::PixelBytes(integral);
+  header_.count = 0;
+  header_.flags = integral ? PatchFile::kIntegral : 0;
+
+  out_.open(filename.c_str(), ofstream::out | ofstream::binary | ofstream::trunc);
+  if (!out_.is_open()) {
+    cout << "ERROR: unable to open " << filename << " for writing." << endl;
+    return false;
+  }
+
+  // Written again with the final count by Close.
+  out_.write((const char*)&header_, sizeof(PatchFileHeader));
+  record_.resize(header_.record_size);
+  return out_.good();
+}
+
+bool PatchFileWriter::Write(const Patch& p) {
+  if ((uint32_t)p.width() != header_.width || (uint32_t)p.height() != header_.height ||
+      (uint32_t)p.channels() != header_.depth) {
+    cout << "ERROR: patch is " << p.width() << "x" << p.height() << "x" << p.channels()
+         << ", expected " << header_.width << "x" << header_.height << "x" << header_.depth << endl;
+    return false;
+  }
+
+  if (p.is_integral()) {
+    cout << "ERROR: patch file records must be written from pixels, not integral images." << endl;
+    return false;
+  }
+
+  bool integral = (header_.flags & PatchFile::kIntegral) != 0;
+  size_t offset = PatchFile::LabelBytes((PatchFile::LabelLayout)header_.label_layout, integral);
+  fill(record_.begin(), record_.begin() + offset, 0);
+  if (header_.label_layout == PatchFile::kRecordLabels) {
+    record_[0] = p.label();
+  } else if (p.label() != header_.label) {
+    cout << "ERROR: patch has label " << (int)p.label() << ", file label is " << header_.label << endl;
+    return false;
+  }
+
+  int num_pixels = p.width() * p.height() * p.channels();
+  pixels_.resize(num_pixels);
+  for (int c = 0; c < p.channels(); c++) {
+    for (int h = 0; h < p.height(); h++) {
+      for (int w = 0; w < p.width(); w++) {
+        float v = min(max(p.Value(w, h, c), 0.0f), 1.0f);
+        pixels_[c * p.width() * p.height() + h * p.width() + w] = (unsigned char)floor(v * 255.0f + 0.5f);
+      }
+    }
+  }
+
+  if (!integral) {
+    memcpy(&record_[offset], &pixels_[0], num_pixels);
+  } else {
+    // Same recurrence as Patch::ComputeIntegralImage, but exact.
+    uint32_t* sums = (uint32_t*)&record_[offset];
+    for (int c = 0; c < p.channels(); c++) {
+      for (int h = 0; h < p.height(); h++) {
+        uint32_t row_total = 0;
+        for (int w = 0; w < p.width(); w++) {
+          int k = c * p.width() * p.height() + h * p.width() + w;
+          uint32_t prev = (h > 0) ? sums[k - p.width()] : 0;
+          row_total += pixels_[k];
+          sums[k] = row_total + prev;
+        }
+      }
+    }
+  }
+
+  out_.write(&record_[0], record_.size());
+  header_.count++;
+  return out_.good();
+}
+
+bool PatchFileWriter::Close() {
+  out_.seekp(0);
+  out_.write((const char*)&header_, sizeof(PatchFileHeader));
+  bool good = out_.good();
+  out_.close();
+  return good;
+}
+
+}  // namespace speedboost
@@ -0,0 +1,172 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_PATCH_FILE_H
+#define SPEEDBOOST_PATCH_FILE_H
+
+#include <cstddef>
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "patch.h"
+
+namespace speedboost {
+
+/**
+ * Header at the start of every patch file.  All fields are stored
+ * in native (little endian) byte order.
+ */
+struct PatchFileHeader {
+  char magic[4];          // "SBPF"
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t depth;
+  uint32_t label_layout;  // PatchFile::LabelLayout
+  int32_t label;          // label of every patch for kFileLabel
+  uint32_t record_size;   // bytes per patch record
+  uint64_t count;         // number of patch records
+  uint32_t flags;         // PatchFile::kIntegral
+  char reserved[20];
+};
+
+/**
+ * Read-only, memory-mapped file of fixed size patch records, as an
+ * alternative to the protobuf patch files written by DataSource.
+ *
+ * After the 64 byte header come count records of record_size bytes.
+ * Each record is an optional label byte (for kRecordLabels) followed
+ * by the width * height * depth pixels, quantized to 8 bits, in the
+ * same order as Patch.  So patch i is at a fixed offset and can be
+ * read directly, without parsing anything.
+ *
+ * With the kIntegral flag, records instead hold the integral image of
+ * the quantized pixels, as uint32 sums of the 8 bit values (with the
+ * label padded to 4 bytes to keep them aligned).  Those patches are
+ * read ready to use, without recomputing the integral image.
+ */
+class PatchFile {
+public:
+  enum LabelLayout {
+    // Every patch has the label in the header.
+    kFileLabel = 0,
+    // Each record starts with its own label.
+    kRecordLabels = 1
+  };
+
+  enum Flags {
+    kIntegral = 1
+  };
+
+  PatchFile();
+  ~PatchFile();
+
+  /**
+   * Map filename and check its header.  Returns false (and prints
+   * why) if it isn't a valid patch file.
+   */
+  bool Open(const std::string& filename);
+  void Close();
+
+  /**
+   * Fill p with record i, converting the pixels back to [0, 1].
+   * For integral files, p gets the integral image.
+   */
+  void Read(size_t i, Patch* p) const;
+
+  /**
+   * Raw record i: the label byte (if any) then the pixels.
+   */
+  inline const unsigned char* Record(size_t i) const {
+    return data_ + sizeof(PatchFileHeader) + i * header_.record_size;
+  }
+
+  inline char Label(size_t i) const {
+    return (header_.label_layout == kRecordLabels) ? (char)(Record(i)[0]) : (char)(header_.label);
+  }
+
+  inline bool is_open() const { return data_ != NULL; }
+  inline bool integral() const { return (header_.flags & kIntegral) != 0; }
+  inline size_t size() const { return header_.count; }
+  inline int width() const { return header_.width; }
+  inline int height() const { return header_.height; }
+  inline int depth() const { return header_.depth; }
+  inline const std::string& filename() const { return filename_; }
+
+  /**
+   * Hint that records will be read in random order, turning off
+   * readahead.
+   */
+  void AdviseRandomAccess() const;
+
+  /**
+   * True if filename starts with the patch file magic number, as
+   * opposed to being a protobuf patch file.
+   */
+  static bool IsPatchFile(const std::string& filename);
+
+  /**
+   * Bytes before the pixels in each record, and bytes per pixel.
+   */
+  static size_t LabelBytes(LabelLayout label_layout, bool integral);
+  static size_t PixelBytes(bool integral);
+
+private:
+  // Not copyable, the mapping is owned by this object.
+  PatchFile(const PatchFile&);
+  PatchFile& operator=(const PatchFile&);
+
+  std::string filename_;
+  PatchFileHeader header_;
+  const unsigned char* data_;
+  size_t size_;
+};
+
+/**
+ * Writes patches to a patch file one at a time, filling in the count
+ * when it is closed.
+ */
+class PatchFileWriter {
+public:
+  PatchFileWriter();
+  ~PatchFileWriter();
+
+  /**
+   * Start a file of width x height x depth patches.  With kFileLabel,
+   * every patch written must have the given label.  If integral, store
+   * integral images instead of pixels.
+   */
+  bool Open(const std::string& filename, int width, int height, int depth,
+            PatchFile::LabelLayout label_layout, int label = 0, bool integral = false);
+
+  /**
+   * Append p, which must not be integrated.  Pixels are clamped to
+   * [0, 1] and rounded to 8 bits.
+   */
+  bool Write(const Patch& p);
+
+  /**
+   * Write the final count to the header and close the file.
+   */
+  bool Close();
+
+  inline size_t count() const { return header_.count; }
+
+private:
+  PatchFileWriter(const PatchFileWriter&);
+  PatchFileWriter& operator=(const PatchFileWriter&);
+
+  std::ofstream out_;
+  PatchFileHeader header_;
+  std::vector<char> record_;
+  std::vector<unsigned char> pixels_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_PATCH_FILE_H
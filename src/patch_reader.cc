@@ -0,0 +1,100 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "patch_reader.h"
+
+using namespace std;
+
+namespace speedboost {
+
+// Patches per chunk pushed onto the queue.
+static const int kChunkSize = 64;
+
+PatchReader::PatchReader(const vector<string>& filenames, const map<string, int>& file_numbers,
+                         int num_threads, int queue_size)
+  : files_(filenames, file_numbers),
+    running_threads_(max(num_threads, 1)),
+    lock_(),
+    queue_(max(queue_size / kChunkSize, 1)),
+    threads_(),
+    chunk_(),
+    chunk_index_(0) {
+  for (int t = 0; t < running_threads_; t++) {
+    threads_.push_back(thread(&PatchReader::ReaderThread, this));
+  }
+}
+
+PatchReader::~PatchReader() {
+  queue_.Clear();
+  for (unsigned int t = 0; t < threads_.size(); t++) {
+    threads_[t].join();
+  }
+}
+
+bool PatchReader::Read(Patch* p) {
+  while (chunk_index_ >= chunk_.size()) {
+    chunk_index_ = 0;
+    if (!queue_.Pop(&chunk_))
+      return false;
+  }
+
+  *p = std::move(chunk_[chunk_index_++]);
+  return true;
+}
+
+bool PatchReader::OpenNextFile(PatchStream* stream) {
+  string filename;
+  int file_number;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (!files_.Next(stream->is_open() ? stream->num_read() : -1, &filename, &file_number))
+      return false;
+  }
+
+  // Open (and map) the file outside the lock.
+  stream->Open(filename, file_number);
+  return true;
+}
+
+void PatchReader::ReaderThread() {
+  PatchStream stream;
+  while (OpenNextFile(&stream)) {
+    vector<Patch> chunk;
+    chunk.reserve(kChunkSize);
+    Patch p;
+    while (stream.Read(&p)) {
+      if (!p.is_integral()) {
+        p.ComputeIntegralImage();
+      }
+      chunk.push_back(std::move(p));
+
+      if ((int)(chunk.size()) == kChunkSize) {
+        if (!queue_.Push(std::move(chunk)))
+          return;
+        chunk.clear();
+        chunk.reserve(kChunkSize);
+      }
+    }
+
+    if (!chunk.empty() && !queue_.Push(std::move(chunk)))
+      return;
+  }
+
+  // Nothing left to read, let the last thread out wake up the caller.
+  lock_guard<mutex> lock(lock_);
+  running_threads_--;
+  if (running_threads_ == 0) {
+    queue_.Close();
+  }
+}
+
+}  // namespace speedboost
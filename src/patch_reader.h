@@ -0,0 +1,80 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_PATCH_READER_H
+#define SPEEDBOOST_PATCH_READER_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.h"
+#include "patch.h"
+#include "patch_stream.h"
+
+namespace speedboost {
+
+/**
+ * Reads patches from a set of files on a pool of threads.  Each thread
+ * takes the next file in a shuffled order, then reads, decodes and
+ * integrates every patch in it, pushing them onto a bounded queue in
+ * small chunks (to keep the locking cost per patch down).
+ * As in DataSource, the files are reshuffled after every pass through
+ * them (see FileCycle), and the reader keeps cycling through them until
+ * it is destroyed.
+ *
+ * Patches from different files are interleaved, so the order depends
+ * on thread timing.
+ */
+class PatchReader {
+public:
+  /**
+   * Start num_threads threads reading filenames, buffering up to
+   * queue_size patches ahead of the caller.  file_numbers gives the
+   * number of each file, for the ids of the patches read from it (see
+   * PatchStream).
+   */
+  PatchReader(const std::vector<std::string>& filenames,
+              const std::map<std::string, int>& file_numbers,
+              int num_threads, int queue_size);
+  ~PatchReader();
+
+  /**
+   * Get the next patch.  Returns false if none of the files contain
+   * any readable patches.
+   */
+  bool Read(Patch* p);
+
+private:
+  // Not copyable, owns the threads.
+  PatchReader(const PatchReader&);
+  PatchReader& operator=(const PatchReader&);
+
+  void ReaderThread();
+
+  /**
+   * Open the next file in stream, as FileCycle::OpenNext but shared
+   * between the threads.  Returns false once the reader gives up.
+   */
+  bool OpenNextFile(PatchStream* stream);
+
+  FileCycle files_;
+  int running_threads_;
+  std::mutex lock_;
+
+  BoundedQueue< std::vector<Patch> > queue_;
+  std::vector<std::thread> threads_;
+
+  // Chunk currently being handed out by Read.
+  std::vector<Patch> chunk_;
+  size_t chunk_index_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_PATCH_READER_H
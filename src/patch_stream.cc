@@ -0,0 +1,132 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "patch_stream.h"
+
+using namespace std;
+
+namespace speedboost {
+
+// Bits of the id below the file number.
+static const int kRecordBits = 40;
+
+PatchStream::PatchStream()
+  : patch_file_(), proto_file_(), in_(), open_(false),
+    position_(0), file_number_(-1), num_read_(0) {
+}
+
+bool PatchStream::Open(const string& filename, int file_number) {
+  Close();
+
+  open_ = true;
+  file_number_ = file_number;
+
+  if (PatchFile::IsPatchFile(filename))
+    return patch_file_.Open(filename);
+  if (proto_file_.Open(filename))
+    return true;
+
+  in_.clear();
+  in_.open(filename.c_str(), ifstream::in | ifstream::binary);
+  return in_.is_open();
+}
+
+void PatchStream::Close() {
+  if (in_.is_open())
+    in_.close();
+  patch_file_.Close();
+  proto_file_.Close();
+
+  open_ = false;
+  position_ = 0;
+  file_number_ = -1;
+  num_read_ = 0;
+}
+
+bool PatchStream::Read(Patch* p) {
+  if (patch_file_.is_open()) {
+    if (position_ >= patch_file_.size())
+      return false;
+
+    // Read resets the id, so set it afterwards.
+    int64_t id = RecordId(file_number_, position_);
+    patch_file_.Read(position_++, p);
+    p->set_id(id);
+    num_read_++;
+    return true;
+  }
+
+  if (proto_file_.is_open()) {
+    // Skip over any corrupt records.
+    while (position_ < proto_file_.bytes()) {
+      int64_t id = RecordId(file_number_, position_);
+      if (proto_file_.ReadAt(&position_, p)) {
+        p->set_id(id);
+        num_read_++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  if (in_.is_open() && p->Read(in_)) {
+    num_read_++;
+    return true;
+  }
+  return false;
+}
+
+int64_t PatchStream::RecordId(int file_number, size_t record) {
+  if (file_number < 0)
+    return -1;
+  return ((int64_t)file_number << kRecordBits) | (int64_t)record;
+}
+
+FileCycle::FileCycle()
+  : filenames_(), file_numbers_(), index_(0), empty_files_(0) {
+}
+
+FileCycle::FileCycle(const vector<string>& filenames, const map<string, int>& file_numbers)
+  : filenames_(filenames), file_numbers_(file_numbers),
+    index_(filenames.size()), empty_files_(0) {
+}
+
+bool FileCycle::Next(int patches_in_last_file, string* filename, int* file_number) {
+  if (patches_in_last_file >= 0) {
+    empty_files_ = (patches_in_last_file > 0) ? 0 : empty_files_ + 1;
+  }
+  if (filenames_.empty() || empty_files_ > (int)(filenames_.size()))
+    return false;
+
+  if (index_ >= (int)(filenames_.size())) {
+    index_ = 0;
+    random_shuffle(filenames_.begin(), filenames_.end());
+  }
+
+  *filename = filenames_[index_++];
+  map<string, int>::const_iterator number = file_numbers_.find(*filename);
+  *file_number = (number != file_numbers_.end()) ? number->second : -1;
+  return true;
+}
+
+bool FileCycle::OpenNext(PatchStream* stream) {
+  string filename;
+  int file_number;
+  if (!Next(stream->is_open() ? stream->num_read() : -1, &filename, &file_number))
+    return false;
+
+  // Files that can't be opened just read no patches, and count as empty.
+  stream->Open(filename, file_number);
+  return true;
+}
+
+}  // namespace speedboost
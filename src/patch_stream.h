@@ -0,0 +1,111 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_PATCH_STREAM_H
+#define SPEEDBOOST_PATCH_STREAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "patch.h"
+#include "patch_file.h"
+#include "proto_patch_file.h"
+
+namespace speedboost {
+
+/**
+ * Reads the patches of one file at a time in order, for all of the
+ * ways patches are streamed (DataSource, PatchReader, ShuffleBuffer).
+ * Patch files (see PatchFile) are mapped and read by record index.
+ * Anything else is protobuf patches, mapped and read by byte offset
+ * (skipping corrupt records), or read from the file if it can't be
+ * mapped.  Patches read from mapped files get an id made from the
+ * file's number and their record (see RecordId).
+ */
+class PatchStream {
+public:
+  PatchStream();
+
+  /**
+   * Start reading filename, closing any file already open.  A
+   * file_number of -1 gives the patches no id.  Returns false if the
+   * file can't be opened, which then just reads no patches.
+   */
+  bool Open(const std::string& filename, int file_number);
+  void Close();
+
+  /**
+   * Read the next patch.  Returns false at the end of the file.
+   */
+  bool Read(Patch* p);
+
+  /**
+   * Id of the given record of file number file_number: the file number
+   * above the record index or byte offset.  -1 if file_number is.
+   */
+  static int64_t RecordId(int file_number, size_t record);
+
+  // Whether a file has been opened since the last Close, even if it
+  // couldn't be read.
+  inline bool is_open() const { return open_; }
+  // Number of patches read from the current file.
+  inline int num_read() const { return num_read_; }
+
+private:
+  // Not copyable, owns the mapped files.
+  PatchStream(const PatchStream&);
+  PatchStream& operator=(const PatchStream&);
+
+  PatchFile patch_file_;
+  ProtoPatchFile proto_file_;
+  std::ifstream in_;
+  bool open_;
+
+  // Record index in the patch file, or byte offset in the proto file.
+  size_t position_;
+  int file_number_;
+  int num_read_;
+};
+
+/**
+ * Cycles through a set of files in a random order, reshuffled after
+ * every pass, giving up once a whole pass of files in a row had no
+ * patches.  Each file keeps a fixed number for the ids of its patches,
+ * which the shuffling doesn't change.  Not thread safe.
+ */
+class FileCycle {
+public:
+  FileCycle();
+  FileCycle(const std::vector<std::string>& filenames,
+            const std::map<std::string, int>& file_numbers);
+
+  /**
+   * Get the next file to read, and its number (-1 if it has none).
+   * patches_in_last_file is the number of patches read from the
+   * previous file, or -1 if there wasn't one.  Returns false once the
+   * files have run dry.
+   */
+  bool Next(int patches_in_last_file, std::string* filename, int* file_number);
+
+  /**
+   * Open the next file in stream, as above.
+   */
+  bool OpenNext(PatchStream* stream);
+
+private:
+  std::vector<std::string> filenames_;
+  std::map<std::string, int> file_numbers_;
+  int index_;
+  int empty_files_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_PATCH_STREAM_H
@@ -10,6 +10,7 @@
 #include "classifier.h"
 #include "feature.h"
 #include "patch.h"
+#include "patch_batch.h"
 
 using namespace speedboost;
 using namespace std;
@@ -35,7 +36,7 @@ int main(int argc, char*argv[])
   google::ParseCommandLineFlags(&argc, &argv, true);
 
   DataSource data(FLAGS_positive_patches_glob, FLAGS_negative_patches_glob);
-  vector<Patch> patches;
+  PatchBatch patches(PatchBatch::kPixelMajor);
   int num_positive = data.GetPositivePatches(FLAGS_max_positives, &patches);
   int num_negative = data.GetNegativePatches(FLAGS_max_negatives, &patches);
   if (num_positive == 0) {
@@ -0,0 +1,276 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "proto_patch_file.h"
+
+using namespace std;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
+namespace speedboost {
+
+// PatchMessage field numbers, see patch.proto.
+enum {
+  kWidthField = 1,
+  kHeightField = 2,
+  kDepthField = 3,
+  kLabelField = 4,
+  kDataField = 5,
+  kIntegralField = 6
+};
+
+ProtoPatchFile::ProtoPatchFile()
+  : data_(NULL), size_(0), modified_(0), offsets_() {
+}
+
+ProtoPatchFile::~ProtoPatchFile() {
+  Close();
+}
+
+bool ProtoPatchFile::Open(const string& filename) {
+  Close();
+
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cout << "ERROR: unable to open patch file " << filename << endl;
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void* data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    cout << "ERROR: unable to map patch file " << filename << endl;
+    return false;
+  }
+
+  // Records are mostly read front to back.
+  madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+  data_ = (const unsigned char*)data;
+  size_ = info.st_size;
+  modified_ = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+  return true;
+}
+
+void ProtoPatchFile::Close() {
+  if (data_) {
+    munmap(const_cast<unsigned char*>(data_), size_);
+  }
+
+  data_ = NULL;
+  size_ = 0;
+  modified_ = 0;
+  offsets_.clear();
+}
+
+bool ProtoPatchFile::Record(size_t offset, const unsigned char** message, size_t* length) const {
+  unsigned int message_length;
+  if (offset + sizeof(unsigned int) > size_)
+    return false;
+  memcpy(&message_length, data_ + offset, sizeof(unsigned int));
+
+  if (offset + sizeof(unsigned int) + message_length > size_)
+    return false;
+
+  *message = data_ + offset + sizeof(unsigned int);
+  *length = message_length;
+  return true;
+}
+
+bool ProtoPatchFile::Decode(size_t offset, PatchRecordInfo* info, float* data, size_t max_values) const {
+  const unsigned char* message;
+  size_t length;
+  if (!Record(offset, &message, &length))
+    return false;
+
+  info->width = 0;
+  info->height = 0;
+  info->depth = 0;
+  info->label = 0;
+  info->integral = false;
+
+  CodedInputStream in(message, length);
+  bool found_data = false;
+  uint32_t tag;
+  while ((tag = in.ReadTag()) != 0) {
+    int field = WireFormatLite::GetTagFieldNumber(tag);
+    WireFormatLite::WireType type = WireFormatLite::GetTagWireType(tag);
+    uint32_t value;
+
+    if (type == WireFormatLite::WIRETYPE_VARINT && field != kDataField) {
+      if (!in.ReadVarint32(&value))
+        return false;
+
+      switch (field) {
+      case kWidthField: info->width = value; break;
+      case kHeightField: info->height = value; break;
+      case kDepthField: info->depth = value; break;
+      case kLabelField: info->label = value; break;
+      case kIntegralField: info->integral = (value != 0); break;
+      default: break;
+      }
+    } else if (field == kDataField && type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) {
+      // The writer puts the sizes first, so the data length can be
+      // checked against them.
+      uint32_t bytes;
+      if (!in.ReadVarint32(&bytes))
+        return false;
+
+      size_t num_values = (size_t)info->width * info->height * info->depth;
+      if (bytes != num_values * sizeof(float) || num_values > max_values)
+        return false;
+
+      if (data) {
+        // Packed floats are little endian, the same as in memory here.
+        if (!in.ReadRaw(data, bytes))
+          return false;
+      } else if (!in.Skip(bytes)) {
+        return false;
+      }
+      found_data = true;
+    } else if (!WireFormatLite::SkipField(&in, tag)) {
+      return false;
+    }
+  }
+
+  return found_data || (info->width * info->height * info->depth == 0);
+}
+
+bool ProtoPatchFile::ReadAt(size_t* offset, Patch* p) const {
+  const unsigned char* message;
+  size_t length;
+  if (!Record(*offset, &message, &length)) {
+    *offset = size_;
+    return false;
+  }
+
+  size_t record_offset = *offset;
+  *offset += sizeof(unsigned int) + length;
+
+  // Sizes first, so the patch can be sized to decode into.
+  PatchRecordInfo info;
+  if (!Decode(record_offset, &info, NULL, (size_t)-1))
+    return false;
+
+  p->Reset(info.label, info.width, info.height, info.depth);
+  if (!Decode(record_offset, &info, p->data_.empty() ? NULL : &p->data_[0], p->data_.size()))
+    return false;
+
+  p->integral_ = info.integral;
+  return true;
+}
+
+size_t ProtoPatchFile::BuildIndex() {
+  offsets_.clear();
+
+  size_t offset = 0;
+  const unsigned char* message;
+  size_t length;
+  while (Record(offset, &message, &length)) {
+    offsets_.push_back(offset);
+    offset += sizeof(unsigned int) + length;
+  }
+
+  return offsets_.size();
+}
+
+// Sidecar index: magic, size and modification time of the indexed file,
+// count, then the offsets.
+static const char kIndexMagic[4] = {'S', 'B', 'P', 'I'};
+
+bool ProtoPatchFile::LoadIndex(const string& index_filename) {
+  ifstream in(index_filename.c_str(), ifstream::in | ifstream::binary);
+  char magic[4];
+  uint64_t file_size, count;
+  int64_t modified;
+  in.read(magic, 4);
+  in.read((char*)&file_size, sizeof(uint64_t));
+  in.read((char*)&modified, sizeof(int64_t));
+  in.read((char*)&count, sizeof(uint64_t));
+  if (!in.good() || memcmp(magic, kIndexMagic, 4) != 0 ||
+      file_size != size_ || modified != modified_)
+    return false;
+
+  vector<uint64_t> offsets(count);
+  if (count > 0) {
+    in.read((char*)&offsets[0], count * sizeof(uint64_t));
+  }
+  if (!in.good())
+    return false;
+
+  offsets_.assign(offsets.begin(), offsets.end());
+  return true;
+}
+
+bool ProtoPatchFile::SaveIndex(const string& index_filename) const {
+  ofstream out(index_filename.c_str(), ofstream::out | ofstream::binary | ofstream::trunc);
+  if (!out.is_open())
+    return false;
+
+  uint64_t file_size = size_;
+  uint64_t count = offsets_.size();
+  vector<uint64_t> offsets(offsets_.begin(), offsets_.end());
+  out.write(kIndexMagic, 4);
+  out.write((const char*)&file_size, sizeof(uint64_t));
+  out.write((const char*)&modified_, sizeof(int64_t));
+  out.write((const char*)&count, sizeof(uint64_t));
+  if (count > 0) {
+    out.write((const char*)&offsets[0], count * sizeof(uint64_t));
+  }
+  return out.good();
+}
+
+void ProtoPatchFile::AdviseRandomAccess() const {
+  if (data_) {
+    madvise(const_cast<unsigned char*>(data_), size_, MADV_RANDOM);
+  }
+}
+
+bool ProtoPatchFile::Read(size_t i, Patch* p) const {
+  assert(i < offsets_.size());
+
+  size_t offset = offsets_[i];
+  return ReadAt(&offset, p);
+}
+
+int ProtoPatchFile::ReadRange(size_t begin, size_t end, vector<Patch>* patches) const {
+  assert(begin <= end && end <= offsets_.size());
+
+  int num_records = end - begin;
+  patches->resize(num_records);
+
+  int num_read = 0;
+  #pragma omp parallel for schedule(static) reduction(+:num_read)
+  for (int i = 0; i < num_records; i++) {
+    if (Read(begin + i, &(*patches)[i])) {
+      num_read++;
+    } else {
+      (*patches)[i] = Patch();
+    }
+  }
+
+  return num_read;
+}
+
+}  // namespace speedboost
@@ -0,0 +1,120 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_PROTO_PATCH_FILE_H
+#define SPEEDBOOST_PROTO_PATCH_FILE_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "patch.h"
+
+namespace speedboost {
+
+/**
+ * Fields of a PatchMessage other than the pixel data.
+ */
+struct PatchRecordInfo {
+  int width, height, depth;
+  char label;
+  bool integral;
+};
+
+/**
+ * Read-only, memory-mapped view of a protobuf patch file, i.e. a
+ * sequence of (4 byte length, serialized PatchMessage) records as
+ * written by Patch::Write.
+ *
+ * Records are decoded in place from the mapping with a
+ * CodedInputStream, and the packed pixel data is copied straight into
+ * the destination, skipping the string and RepeatedField copies of
+ * Patch::Read.  Records can be read sequentially by byte offset, or
+ * by index once BuildIndex has found where each one starts.
+ */
+class ProtoPatchFile {
+public:
+  ProtoPatchFile();
+  ~ProtoPatchFile();
+
+  bool Open(const std::string& filename);
+  void Close();
+
+  /**
+   * Decode the record starting at *offset into p, and move *offset
+   * on to the next record.  Returns false at the end of the file, or
+   * if the record is corrupt (in which case *offset still skips it
+   * when its length is intact).
+   */
+  bool ReadAt(size_t* offset, Patch* p) const;
+
+  /**
+   * Decode the record at offset into info and data, which must have
+   * room for max_values floats.  If data is NULL only info is filled
+   * in.  Returns false if the record is corrupt or too large.
+   */
+  bool Decode(size_t offset, PatchRecordInfo* info, float* data, size_t max_values) const;
+
+  /**
+   * Find the offset of every record, for Read and ReadRange.
+   * Returns the number of records.
+   */
+  size_t BuildIndex();
+
+  /**
+   * Load or save the record offsets from a sidecar index file, so
+   * BuildIndex doesn't need to touch every record.  LoadIndex fails if
+   * the file has changed size or been modified since the index was
+   * written.
+   */
+  bool LoadIndex(const std::string& index_filename);
+  bool SaveIndex(const std::string& index_filename) const;
+
+  /**
+   * Hint that records will be read in random order, turning off
+   * readahead.
+   */
+  void AdviseRandomAccess() const;
+
+  /**
+   * Decode record i (after BuildIndex).
+   */
+  bool Read(size_t i, Patch* p) const;
+
+  /**
+   * Decode records [begin, end) into patches, in parallel.  Returns
+   * the number of records decoded successfully; failed records are
+   * left empty.
+   */
+  int ReadRange(size_t begin, size_t end, std::vector<Patch>* patches) const;
+
+  inline bool is_open() const { return data_ != NULL; }
+  inline size_t bytes() const { return size_; }
+  inline size_t size() const { return offsets_.size(); }
+  inline const std::vector<size_t>& offsets() const { return offsets_; }
+
+private:
+  // Not copyable, the mapping is owned by this object.
+  ProtoPatchFile(const ProtoPatchFile&);
+  ProtoPatchFile& operator=(const ProtoPatchFile&);
+
+  /**
+   * Find the message at offset, returning false if the length prefix
+   * runs past the end of the file.
+   */
+  bool Record(size_t offset, const unsigned char** message, size_t* length) const;
+
+  const unsigned char* data_;
+  size_t size_;
+  // Modification time of the file, in ns, to check sidecar indexes.
+  int64_t modified_;
+  std::vector<size_t> offsets_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_PROTO_PATCH_FILE_H
@@ -0,0 +1,163 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "data_source.h"
+#include "resampling_pool.h"
+
+using namespace std;
+
+namespace speedboost {
+
+ResamplingPool::ResamplingPool(DataSource* data, bool positive, int size, float refresh_fraction)
+  : data_(data), positive_(positive), max_size_(size), refresh_fraction_(refresh_fraction),
+    classifier_(NULL), pool_(), states_(), weights_(), cumulative_() {
+}
+
+void ResamplingPool::ReadPatches(int num_patches, vector<Patch>* patches) {
+  if (positive_) {
+    data_->GetPositivePatches(num_patches, patches);
+  } else {
+    data_->GetNegativePatches(num_patches, patches);
+  }
+}
+
+void ResamplingPool::Fill() {
+  pool_.clear();
+  ReadPatches(max_size_, &pool_);
+  states_.assign(pool_.size(), ActivationState());
+
+  cout << "Loaded " << pool_.size() << (positive_ ? " positive" : " negative")
+       << " patches into the resampling pool." << endl;
+}
+
+void ResamplingPool::Refresh() {
+  int num_replaced = (int)(refresh_fraction_ * pool_.size());
+  if (num_replaced <= 0)
+    return;
+
+  vector<Patch> fresh;
+  ReadPatches(num_replaced, &fresh);
+
+  // Overwrite random slots, so the whole pool gets replaced over time.
+  for (unsigned int i = 0; i < fresh.size(); i++) {
+    int slot = rand() % pool_.size();
+    pool_[slot] = std::move(fresh[i]);
+    states_[slot] = ActivationState();
+  }
+
+  cout << "Replaced " << fresh.size() << (positive_ ? " positive" : " negative")
+       << " patches in the resampling pool." << endl;
+}
+
+double ResamplingPool::Score(const Classifier& c) {
+  if (pool_.empty()) {
+    Fill();
+  } else {
+    Refresh();
+  }
+
+  if (&c != classifier_) {
+    states_.assign(pool_.size(), ActivationState());
+    classifier_ = &c;
+  }
+
+  int n = pool_.size();
+  weights_.resize(n);
+  cumulative_.resize(n);
+
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < n; i++) {
+    float y = (pool_[i].label() > 0) ? 1.0 : -1.0;
+    weights_[i] = exp(-y * c.ResumeActivation(pool_[i], &states_[i]));
+  }
+
+  double total = 0.0;
+  for (int i = 0; i < n; i++) {
+    total += weights_[i];
+    cumulative_[i] = total;
+  }
+  return total;
+}
+
+int ResamplingPool::Draw(int max_num_patches, vector<float>* weights,
+                         vector<Patch>* patches, PatchBatch* batch) {
+  int n = pool_.size();
+  if (n == 0 || max_num_patches <= 0)
+    return 0;
+
+  if (batch) {
+    batch->Reserve(batch->size() + max_num_patches);
+  } else {
+    patches->reserve(patches->size() + max_num_patches);
+  }
+  weights->reserve(weights->size() + max_num_patches);
+
+  // Systematic resampling: max_num_patches evenly spaced points with a
+  // random offset, each hitting the patch whose weight interval holds it.
+  double step = cumulative_[n - 1] / (double)max_num_patches;
+  double point = step * (double)rand() / ((double)RAND_MAX + 1.0);
+  int num_points = 0;
+  int num_added = 0;
+  for (int i = 0; i < n && num_points < max_num_patches; i++) {
+    int hits = 0;
+    while (point < cumulative_[i] && num_points < max_num_patches) {
+      hits++;
+      num_points++;
+      point += step;
+    }
+
+    if (hits > 0) {
+      // The pool stays resident, so copy the patch out.
+      if (batch) {
+        batch->Append(pool_[i]);
+      } else {
+        patches->push_back(pool_[i]);
+      }
+      weights->push_back((float)hits / weights_[i]);
+      num_added++;
+    }
+  }
+  return num_added;
+}
+
+int ResamplingPool::Sample(int max_num_patches, const Classifier& c,
+                           vector<float>* weights, vector<Patch>* patches, PatchBatch* batch) {
+  double total = Score(c);
+  int num_added = Draw(max_num_patches, weights, patches, batch);
+
+  cout << "Sampled " << num_added << " patches from a pool of " << pool_.size()
+       << ", total weight: " << total << endl;
+  return num_added;
+}
+
+int ResamplingPool::Sample(ResamplingPool* positives, ResamplingPool* negatives,
+                           int max_num_patches, const Classifier& c, vector<float>* weights,
+                           vector<Patch>* patches, PatchBatch* batch) {
+  double positive_total = positives->Score(c);
+  double negative_total = negatives->Score(c);
+  double total = positive_total + negative_total;
+  if (total <= 0.0)
+    return 0;
+
+  // Each label gets the share of the points that would land on it
+  // if the two pools were one.
+  int num_positive = (int)(max_num_patches * positive_total / total + 0.5);
+  int num_added = positives->Draw(num_positive, weights, patches, batch);
+  num_added += negatives->Draw(max_num_patches - num_positive, weights, patches, batch);
+
+  cout << "Sampled " << num_added << " patches from pools of " << positives->size()
+       << " positives and " << negatives->size() << " negatives, total weight: "
+       << total << endl;
+  return num_added;
+}
+
+}  // namespace speedboost
@@ -0,0 +1,103 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_RESAMPLING_POOL_H
+#define SPEEDBOOST_RESAMPLING_POOL_H
+
+#include <vector>
+
+#include "classifier.h"
+#include "patch.h"
+#include "patch_batch.h"
+
+namespace speedboost {
+
+class DataSource;
+
+/**
+ * A large pool of candidate patches of one label kept in memory across
+ * training stages, for resampling training sets by boosting weight.
+ *
+ * Each call to Sample scores the whole pool in parallel, only
+ * evaluating the stumps added since the last call (see
+ * Classifier::ResumeActivation), computes the weights exp(-y f(x)),
+ * and draws the sample with the same low variance (systematic)
+ * resampler as DataSource::GetPatchesSampled, run over the prefix sums
+ * of the weights.  Between calls, refresh_fraction of the pool is
+ * replaced with newly read patches so the pool slowly covers more of
+ * the data.
+ *
+ * Positives and negatives are kept in separate pools, so sampling one
+ * label never disturbs the other's patches or cached activations.
+ */
+class ResamplingPool {
+public:
+  ResamplingPool(DataSource* data, bool positive, int size, float refresh_fraction);
+
+  /**
+   * Sample up to max_num_patches distinct patches from the pool.
+   * weights gets the weight adjusting for the sampling of each, as in
+   * DataSource::GetPatchesSampled.  Exactly one of patches and batch is
+   * non-NULL and receives the patches.  Returns the number sampled.
+   */
+  int Sample(int max_num_patches, const Classifier& c,
+             std::vector<float>* weights, std::vector<Patch>* patches, PatchBatch* batch);
+
+  /**
+   * As above, but sample from positives and negatives together, as one
+   * pool holding both.  The draws are split between the two by their
+   * total weight.
+   */
+  static int Sample(ResamplingPool* positives, ResamplingPool* negatives,
+                    int max_num_patches, const Classifier& c, std::vector<float>* weights,
+                    std::vector<Patch>* patches, PatchBatch* batch);
+
+  inline int size() const { return pool_.size(); }
+
+private:
+  // Not copyable, the pool can be very large.
+  ResamplingPool(const ResamplingPool&);
+  ResamplingPool& operator=(const ResamplingPool&);
+
+  /**
+   * Read num_patches patches of this pool's label onto the end of patches.
+   */
+  void ReadPatches(int num_patches, std::vector<Patch>* patches);
+
+  void Fill();
+  void Refresh();
+
+  /**
+   * Fill or refresh the pool and compute the weight of every patch
+   * under c.  Returns the total weight.
+   */
+  double Score(const Classifier& c);
+
+  /**
+   * Draw max_num_patches points from the weights computed by Score.
+   */
+  int Draw(int max_num_patches, std::vector<float>* weights,
+           std::vector<Patch>* patches, PatchBatch* batch);
+
+  DataSource* data_;
+  bool positive_;
+  int max_size_;
+  float refresh_fraction_;
+
+  // Classifier the states are for.
+  const Classifier* classifier_;
+
+  std::vector<Patch> pool_;
+  std::vector<ActivationState> states_;
+
+  // Scratch space for the weights and their prefix sums.
+  std::vector<float> weights_;
+  std::vector<double> cumulative_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_RESAMPLING_POOL_H
@@ -0,0 +1,111 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "response_store.h"
+
+using namespace std;
+
+namespace speedboost {
+
+ResponseStore::ResponseStore()
+  : data_(NULL), size_(0), block_size_(0),
+    num_features_(0), num_examples_(0), file_backed_(false) {
+}
+
+ResponseStore::~ResponseStore() {
+  Free();
+}
+
+void ResponseStore::Free() {
+  if (data_) {
+    munmap(data_, size_);
+  }
+
+  data_ = NULL;
+  size_ = 0;
+  block_size_ = 0;
+  num_features_ = 0;
+  num_examples_ = 0;
+  file_backed_ = false;
+}
+
+bool ResponseStore::Allocate(int num_features, int num_examples, const string& directory) {
+  Free();
+
+  block_size_ = (size_t)num_examples * (sizeof(float) + sizeof(int));
+  size_ = (size_t)num_features * block_size_;
+  if (size_ == 0) {
+    num_features_ = num_features;
+    num_examples_ = num_examples;
+    return true;
+  }
+
+  void* data = MAP_FAILED;
+  if (directory == "") {
+    data = mmap(NULL, size_, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  } else {
+    // mkstemp fills in the X's, so it needs a writable copy of the template.
+    string path = directory + "/responses.XXXXXX";
+    vector<char> writable(path.begin(), path.end());
+    writable.push_back('\0');
+    int fd = mkstemp(&writable[0]);
+    path = &writable[0];
+    if (fd < 0) {
+      cout << "ERROR: unable to create response store file in " << directory << endl;
+      return false;
+    }
+
+    // The file is only scratch space, so remove it as soon as it is mapped
+    // and let the kernel clean it up when we exit.
+    unlink(path.c_str());
+
+    if (ftruncate(fd, size_) == 0) {
+      data = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    file_backed_ = true;
+  }
+
+  if (data == MAP_FAILED) {
+    cout << "ERROR: unable to map " << size_ / (1024 * 1024) << " MB for response store." << endl;
+    size_ = 0;
+    block_size_ = 0;
+    file_backed_ = false;
+    return false;
+  }
+
+  data_ = (char*)data;
+  num_features_ = num_features;
+  num_examples_ = num_examples;
+
+  cout << "Allocated " << size_ / (1024 * 1024) << " MB response store"
+       << (file_backed_ ? (" in " + directory) : string(" in memory")) << "." << endl;
+  return true;
+}
+
+void ResponseStore::Prefetch(int f) const {
+  if (!file_backed_ || f < 0 || f >= num_features_)
+    return;
+
+  // madvise needs a page aligned address.
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t begin = (size_t)f * block_size_;
+  size_t aligned = begin - (begin % page_size);
+
+  madvise(data_ + aligned, block_size_ + (begin - aligned), MADV_WILLNEED);
+}
+
+}  // namespace speedboost
@@ -0,0 +1,82 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_RESPONSE_STORE_H
+#define SPEEDBOOST_RESPONSE_STORE_H
+
+#include <cstddef>
+#include <string>
+
+namespace speedboost {
+
+/**
+ * Storage for the feature responses and sorted example orders used
+ * by FeatureSelector.  Data is laid out in feature-major blocks, with
+ * the responses for feature f immediately followed by the sorted order
+ * of the examples for feature f:
+ *
+ *   [ responses(0) | sorted(0) | responses(1) | sorted(1) | ... ]
+ *
+ * If a directory is given, the blocks are backed by a memory-mapped
+ * scratch file in that directory, so the store can be much larger than
+ * physical memory and gets paged in as it is streamed through.
+ * Otherwise the blocks are kept in anonymous memory.
+ */
+class ResponseStore {
+public:
+  ResponseStore();
+  ~ResponseStore();
+
+  /**
+   * Allocate space for num_features blocks of num_examples examples.
+   * If directory is non-empty, back the store with a file there.
+   * Returns false if the memory or file could not be mapped.
+   */
+  bool Allocate(int num_features, int num_examples, const std::string& directory);
+
+  inline float* responses(int f) {
+    return (float*)(data_ + (size_t)f * block_size_);
+  }
+  inline const float* responses(int f) const {
+    return (const float*)(data_ + (size_t)f * block_size_);
+  }
+
+  inline int* sorted(int f) {
+    return (int*)(data_ + (size_t)f * block_size_ + (size_t)num_examples_ * sizeof(float));
+  }
+  inline const int* sorted(int f) const {
+    return (const int*)(data_ + (size_t)f * block_size_ + (size_t)num_examples_ * sizeof(float));
+  }
+
+  /**
+   * Hint that the block for feature f will be read soon, so it
+   * can be paged in ahead of time when the store is file backed.
+   */
+  void Prefetch(int f) const;
+
+  inline int num_features() const { return num_features_; }
+  inline int num_examples() const { return num_examples_; }
+  inline bool file_backed() const { return file_backed_; }
+
+private:
+  // Not copyable, the mapping is owned by this object.
+  ResponseStore(const ResponseStore&);
+  ResponseStore& operator=(const ResponseStore&);
+
+  void Free();
+
+  char* data_;
+  size_t size_;
+  size_t block_size_;
+
+  int num_features_;
+  int num_examples_;
+  bool file_backed_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_RESPONSE_STORE_H
@@ -0,0 +1,85 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "shuffle_buffer.h"
+
+using namespace std;
+
+namespace speedboost {
+
+ShuffleBuffer::ShuffleBuffer(const vector<string>& filenames, const map<string, int>& file_numbers,
+                             int num_shards, int buffer_size)
+  : files_(filenames, file_numbers),
+    exhausted_(false),
+    shards_(),
+    buffer_(),
+    capacity_(max(buffer_size, 1)) {
+  // More shards than files would only read the same files twice over.
+  int n = max(min(num_shards, (int)filenames.size()), 1);
+  for (int s = 0; s < n; s++) {
+    shards_.push_back(new PatchStream());
+  }
+
+  buffer_.reserve(capacity_);
+}
+
+ShuffleBuffer::~ShuffleBuffer() {
+  for (unsigned int s = 0; s < shards_.size(); s++) {
+    delete shards_[s];
+  }
+}
+
+bool ShuffleBuffer::Read(Patch* p) {
+  // Fill the buffer up before handing anything out.
+  while (buffer_.size() < capacity_ && !exhausted_) {
+    Patch next;
+    if (!ReadNext(&next))
+      break;
+    buffer_.push_back(std::move(next));
+  }
+
+  if (buffer_.empty())
+    return false;
+
+  size_t slot = (size_t)((double)rand() / ((double)RAND_MAX + 1.0) * buffer_.size());
+  *p = std::move(buffer_[slot]);
+
+  // Once the files run dry the buffer just drains.
+  Patch next;
+  if (ReadNext(&next)) {
+    buffer_[slot] = std::move(next);
+  } else {
+    buffer_[slot] = std::move(buffer_.back());
+    buffer_.pop_back();
+  }
+  return true;
+}
+
+bool ShuffleBuffer::ReadNext(Patch* p) {
+  if (exhausted_)
+    return false;
+
+  return ReadShard(shards_[rand() % shards_.size()], p);
+}
+
+bool ShuffleBuffer::ReadShard(PatchStream* shard, Patch* p) {
+  while (!shard->Read(p)) {
+    if (!files_.OpenNext(shard)) {
+      exhausted_ = true;
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace speedboost
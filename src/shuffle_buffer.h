@@ -0,0 +1,80 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#ifndef SPEEDBOOST_SHUFFLE_BUFFER_H
+#define SPEEDBOOST_SHUFFLE_BUFFER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "patch.h"
+#include "patch_stream.h"
+
+namespace speedboost {
+
+/**
+ * Streams patches from several files (shards) at once through a buffer,
+ * to break up the order of the patches in the files.
+ *
+ * Up to num_shards files are open at a time, each read sequentially
+ * from start to end.  The buffer starts out holding buffer_size patches
+ * drawn from the shards at random, and each read takes a random patch
+ * out of it and replaces it with the next patch of a random shard.
+ * Consecutive reads then come from far apart in the data while every
+ * file is still read in order.
+ *
+ * As in DataSource, the files are reshuffled after every pass through
+ * them (see FileCycle), and the shards keep cycling through them.
+ */
+class ShuffleBuffer {
+public:
+  /**
+   * file_numbers gives the number of each of filenames, for the ids of
+   * the patches read from it (see PatchStream).
+   */
+  ShuffleBuffer(const std::vector<std::string>& filenames,
+                const std::map<std::string, int>& file_numbers,
+                int num_shards, int buffer_size);
+  ~ShuffleBuffer();
+
+  /**
+   * Get a random patch from the buffer.  Returns false if none of the
+   * files contain any readable patches.
+   */
+  bool Read(Patch* p);
+
+  inline int size() const { return buffer_.size(); }
+  inline int num_shards() const { return shards_.size(); }
+
+private:
+  // Not copyable, owns the open files.
+  ShuffleBuffer(const ShuffleBuffer&);
+  ShuffleBuffer& operator=(const ShuffleBuffer&);
+
+  /**
+   * Read the next patch of a random shard.
+   */
+  bool ReadNext(Patch* p);
+
+  /**
+   * Read the next patch of shard, moving it on to the next file
+   * when it runs out.
+   */
+  bool ReadShard(PatchStream* shard, Patch* p);
+
+  FileCycle files_;
+  bool exhausted_;
+
+  std::vector<PatchStream*> shards_;
+
+  std::vector<Patch> buffer_;
+  size_t capacity_;
+};
+
+}  // namespace speedboost
+
+#endif  // ifndef SPEEDBOOST_SHUFFLE_BUFFER_H
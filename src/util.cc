@@ -4,6 +4,9 @@
 // @author Alex Grubb (agrubb@cmu.edu)
 //
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <glob.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
@@ -109,4 +112,82 @@ bool WriteMessageToFileAsText(const string& filename, const Message& msg) {
   return true;
 }
 
+/**
+ * Map a float onto an unsigned int with the same ordering, by flipping
+ * all the bits of negative numbers and just the sign bit of positive ones.
+ */
+static inline unsigned int SortableKey(float v) {
+  unsigned int bits;
+
+  // Fold -0 into +0 so they compare equal, as they do for floats.
+  if (v == 0.0f) v = 0.0f;
+  memcpy(&bits, &v, sizeof(bits));
+
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+void RadixArgsort(const float* values, int n, int* order, vector<unsigned int>* scratch) {
+  // Three passes of 11, 11 and 10 bits.
+  const int kPasses = 3;
+  const int kBits = 11;
+  const int kBuckets = 1 << kBits;
+
+  scratch->resize(3 * (size_t)n + kPasses * kBuckets);
+  unsigned int* keys = &(*scratch)[0];
+  unsigned int* keys_tmp = keys + n;
+  unsigned int* order_tmp = keys_tmp + n;
+  unsigned int* counts = order_tmp + n;
+
+  memset(counts, 0, kPasses * kBuckets * sizeof(unsigned int));
+  for (int i = 0; i < n; i++) {
+    unsigned int k = SortableKey(values[i]);
+    keys[i] = k;
+    order[i] = i;
+    for (int pass = 0; pass < kPasses; pass++) {
+      counts[pass * kBuckets + ((k >> (pass * kBits)) & (kBuckets - 1))]++;
+    }
+  }
+
+  unsigned int* src_keys = keys;
+  unsigned int* dst_keys = keys_tmp;
+  unsigned int* src_order = (unsigned int*)order;
+  unsigned int* dst_order = order_tmp;
+  for (int pass = 0; pass < kPasses; pass++) {
+    unsigned int* count = counts + pass * kBuckets;
+    int shift = pass * kBits;
+
+    // Skip passes where every key lands in the same bucket.
+    bool trivial = false;
+    unsigned int total = 0;
+    for (int b = 0; b < kBuckets; b++) {
+      if (count[b] == (unsigned int)n) trivial = true;
+      unsigned int c = count[b];
+      count[b] = total;
+      total += c;
+    }
+    if (trivial) continue;
+
+    for (int i = 0; i < n; i++) {
+      unsigned int k = src_keys[i];
+      unsigned int pos = count[(k >> shift) & (kBuckets - 1)]++;
+      dst_keys[pos] = k;
+      dst_order[pos] = src_order[i];
+    }
+
+    swap(src_keys, dst_keys);
+    swap(src_order, dst_order);
+  }
+
+  if (src_order != (unsigned int*)order) {
+    memcpy(order, src_order, n * sizeof(int));
+  }
+}
+
+uint64_t RandomIndex(uint64_t n) {
+  // 62 random bits, so the bias of the modulo is negligible for any n
+  // that fits in memory or on disk.
+  uint64_t r = ((uint64_t)rand() << 31) | (uint64_t)rand();
+  return r % n;
+}
+
 }  // namespace speedboost
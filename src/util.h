@@ -7,8 +7,12 @@
 #ifndef SPEEDBOOST_UTIL_H
 #define SPEEDBOOST_UTIL_H
 
+#include <algorithm>
+#include <cstdint>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/message.h>
+#include <string>
+#include <vector>
 
 namespace speedboost {
 
@@ -32,6 +36,56 @@ void WriteMessage(std::ostream& out, const google::protobuf::Message& msg);
 bool ReadMessageFromFileAsText(const std::string& filename, google::protobuf::Message* msg);
 bool WriteMessageToFileAsText(const std::string& filename, const google::protobuf::Message& msg);
 
+/**
+ * Compute the indices that sort values[0..n) in ascending order,
+ * storing them in order.  Uses a stable LSD radix sort on the float
+ * bit patterns, so ties keep their original (index) order, the same
+ * as sorting (value, index) pairs.  Scratch is resized as needed and
+ * can be reused across calls to avoid reallocating.
+ */
+void RadixArgsort(const float* values, int n, int* order, std::vector<unsigned int>* scratch);
+
+/**
+ * Uniformly random index in [0, n), from rand().  A single rand() only
+ * has 2^31 values, so two are combined to reach every index of data
+ * sets with billions of examples.
+ */
+uint64_t RandomIndex(uint64_t n);
+
+/**
+ * Approximate exp(x) for single precision floats, with relative error
+ * below 1e-6.  Inputs are clamped to [-87, 88] so the result stays a
+ * normal float.  Written without branches or library calls, so loops
+ * using it can be vectorized.
+ */
+inline float FastExp(float x) {
+  x = std::min(std::max(x, -87.0f), 88.0f);
+
+  // exp(x) = 2^n * exp(r), with n = round(x / ln 2) and |r| <= ln(2) / 2.
+  // Adding and removing 1.5 * 2^23 rounds to the nearest integer, and
+  // ln 2 is split in two so r is computed without losing precision.
+  float n = (x * 1.442695041f + 12582912.0f) - 12582912.0f;
+  float r = x - n * 0.693359375f;
+  r = r + n * 2.12194440e-4f;
+
+  // Taylor series of exp(r), accurate to about 1.2e-7 for |r| <= ln(2) / 2.
+  float p = 1.0f / 720.0f;
+  p = p * r + 1.0f / 120.0f;
+  p = p * r + 1.0f / 24.0f;
+  p = p * r + 1.0f / 6.0f;
+  p = p * r + 0.5f;
+  p = p * r + 1.0f;
+  p = p * r + 1.0f;
+
+  union {
+    int i;
+    float f;
+  } scale;
+  scale.i = ((int)n + 127) << 23;
+
+  return p * scale.f;
+}
+
 }  // namespace speedboost
 
 #endif  // ifndef SPEEDBOOST_UTIL_H
@@ -4,6 +4,7 @@
 // @author Alex Grubb (agrubb@cmu.edu)
 //
 
+#include <climits>
 #include <cmath>
 #include <gflags/gflags.h>
 #include <gtest/gtest.h>
@@ -233,3 +234,72 @@ TEST(DetectorTest, ComputeActivationPyramidSingleScaleMultiChannel) {
   ASSERT_EQ(activation_pyramid.size(), 1);
   VerifyActivations(activation_pyramid[0], frame, c, 0.02);
 }
+
+TEST(DetectorTest, ComputeActiveWindows) {
+  int patch_width = FLAGS_patch_width;
+  int patch_height = FLAGS_patch_height;
+  int patch_depth = FLAGS_patch_depth;
+  FLAGS_patch_width = 8;
+  FLAGS_patch_height = 8;
+  FLAGS_patch_depth = 1;
+
+  // Integer pixels, so the sums are exact either way they are computed.
+  Patch frame(0, 40, 30, 1);
+  for (int x = 0; x < frame.width(); x++) {
+    for (int y = 0; y < frame.height(); y++) {
+      frame.SetValue(x, y, 0, (x * 13 + y * 7 + x * y) % 17);
+    }
+  }
+
+  vector<Feature> features;
+  Feature::GenerateFeatures(5, &features);
+
+  // Two trained stages, and an empty one waiting for its negatives.
+  Classifier c;
+  c.type_ = Classifier::kCascade;
+  c.filters_are_additive_ = false;
+  c.filters_are_permanent_ = true;
+  for (int i = 0; i < 3; i++) {
+    Filter filter;
+    if (i > 0) {
+      filter.active_ = true;
+      filter.less_ = false;
+      filter.threshold_ = -0.5;
+    }
+    c.chains_.push_back(Chain());
+    c.filters_.push_back(filter);
+    for (int j = 0; i < 2 && j < 2; j++) {
+      c.chains_.back().stumps_.push_back(DecisionStump(features[2 * i + j], 0.0, (j % 2) ? 1.0 : -1.0));
+      c.chains_.back().weights_.push_back(1.0);
+    }
+  }
+
+  Detector detector(&c, 1.0, 1, 1.2, 0.0);
+  unsigned int seed = 0;
+  vector<Patch> windows;
+  detector.ComputeActiveWindows(frame, INT_MAX, &seed, &windows);
+
+  Patch integral(frame);
+  integral.ComputeIntegralImage();
+  int num_active = 0;
+  for (int y = 0; y + 8 <= frame.height(); y++) {
+    for (int x = 0; x + 8 <= frame.width(); x++) {
+      Patch window;
+      integral.CutIntegralWindow(x, y, 8, 8, &window);
+      num_active += c.IsActiveInLastChain(window);
+    }
+  }
+
+  EXPECT_EQ(num_active, (int)windows.size());
+  for (unsigned int w = 0; w < windows.size(); w++) {
+    EXPECT_TRUE(c.IsActiveInLastChain(windows[w]));
+  }
+
+  vector<Patch> subset;
+  detector.ComputeActiveWindows(frame, 5, &seed, &subset);
+  EXPECT_EQ(min(5, num_active), (int)subset.size());
+
+  FLAGS_patch_width = patch_width;
+  FLAGS_patch_height = patch_height;
+  FLAGS_patch_depth = patch_depth;
+}
@@ -0,0 +1,499 @@
+//
+// Copyright 2011 Carnegie Mellon University
+//
+// @author Alex Grubb (agrubb@cmu.edu)
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <utility>
+#include <vector>
+
+#include "classifier.h"
+#include "common.h"
+#include "data_source.h"
+#include "feature.h"
+#include "feature_selector.h"
+#include "patch.h"
+#include "patch_batch.h"
+#include "patch_file.h"
+#include "util.h"
+
+using namespace std;
+using namespace speedboost;
+
+DECLARE_int32(bandit_initial_samples);
+DECLARE_int32(bandit_final_features);
+DECLARE_int32(resample_pool_size);
+DECLARE_bool(activation_cache);
+
+class FeatureSelectorTest : public testing::Test {
+protected:
+  virtual void SetUp() {
+    FLAGS_patch_width = 10;
+    FLAGS_patch_height = 10;
+    FLAGS_patch_depth = 1;
+
+    srand(0);
+    for (int i = 0; i < 500; i++) {
+      Patch p((i % 4 == 0) ? 1 : 0, 10, 10, 1);
+      for (int w = 0; w < p.width(); w++) {
+        for (int h = 0; h < p.height(); h++) {
+          // Coarse values so plenty of features have tied responses.
+          float v = (rand() % 4) / 4.0;
+          if (p.label() > 0 && w < 5) v += 0.5;
+          p.SetValue(w, h, 0, v);
+        }
+      }
+      p.ComputeIntegralImage();
+      patches.push_back(p);
+    }
+
+    Feature::GenerateFeatures(50, &features);
+  }
+
+  vector<Patch> patches;
+  vector<Feature> features;
+};
+
+TEST(RadixArgsortTest, MatchesSortedPairs) {
+  srand(0);
+  vector<float> values;
+  for (int i = 0; i < 5000; i++) {
+    // Mix of negatives, positives, zeros of both signs and duplicates.
+    float v = (float)(rand() % 2000 - 1000) / 7.0;
+    if (i % 50 == 0) v = 0.0;
+    if (i % 51 == 0) v = -0.0;
+    if (i % 13 == 0) v = v * 1e6;
+    values.push_back(v);
+  }
+
+  vector< pair<float, int> > sortable(values.size());
+  for (int i = 0; i < (int)(values.size()); i++) {
+    sortable[i].first = values[i];
+    sortable[i].second = i;
+  }
+  sort(sortable.begin(), sortable.end());
+
+  vector<int> order(values.size());
+  vector<unsigned int> scratch;
+  RadixArgsort(&values[0], values.size(), &order[0], &scratch);
+
+  for (int i = 0; i < (int)(values.size()); i++) {
+    EXPECT_EQ(sortable[i].second, order[i]);
+  }
+}
+
+TEST(FastExpTest, RelativeError) {
+  for (float x = -80.0; x < 80.0; x += 0.001) {
+    double expected = exp((double)x);
+    EXPECT_NEAR(1.0, FastExp(x) / expected, 1e-6) << "x = " << x;
+  }
+}
+
+TEST_F(FeatureSelectorTest, SortedOrders) {
+  FeatureSelector selector(patches, features);
+
+  for (int f = 0; f < (int)(features.size()); f++) {
+    const float* responses = selector.store.responses(f);
+    const int* sorted = selector.store.sorted(f);
+
+    vector<bool> seen(patches.size(), false);
+    for (int p = 0; p < (int)(patches.size()); p++) {
+      EXPECT_FLOAT_EQ(features[f].Evaluate(patches[p]), responses[p]);
+
+      ASSERT_GE(sorted[p], 0);
+      ASSERT_LT(sorted[p], (int)(patches.size()));
+      EXPECT_FALSE(seen[sorted[p]]);
+      seen[sorted[p]] = true;
+
+      if (p > 0) {
+        EXPECT_LE(responses[sorted[p - 1]], responses[sorted[p]]);
+      }
+    }
+  }
+}
+
+TEST_F(FeatureSelectorTest, BatchEvaluate) {
+  PatchBatch batch(PatchBatch::kPixelMajor);
+  batch.Append(patches);
+
+  vector< vector<float> > responses(features.size(), vector<float>(patches.size()));
+  vector<float*> pointers(features.size());
+  for (int f = 0; f < (int)(features.size()); f++) {
+    pointers[f] = &responses[f][0];
+  }
+  Feature::EvaluateBlock(&features[0], features.size(), batch, &pointers[0]);
+
+  vector<float> partial(100);
+  for (int f = 0; f < (int)(features.size()); f++) {
+    features[f].Evaluate(batch, 150, 250, &partial[0]);
+    for (int p = 0; p < (int)(patches.size()); p++) {
+      EXPECT_EQ(features[f].Evaluate(patches[p]), responses[f][p]);
+      if (p >= 150 && p < 250) {
+        EXPECT_EQ(responses[f][p], partial[p - 150]);
+      }
+    }
+  }
+}
+
+TEST_F(FeatureSelectorTest, ReplaceExamplesMatchesRebuild) {
+  FeatureSelector selector(patches, features);
+
+  // Replace every third example with a (relabeled) copy of another one.
+  vector<int> slots;
+  vector<Patch> fresh;
+  for (int p = 0; p < (int)(patches.size()); p += 3) {
+    Patch q = patches[(p * 7 + 1) % patches.size()];
+    q.set_label(patches[p].label());
+    slots.push_back(p);
+    fresh.push_back(q);
+  }
+  for (int i = 0; i < (int)(slots.size()); i++) {
+    patches[slots[i]] = fresh[i];
+  }
+  selector.ReplaceExamples(slots, fresh);
+
+  FeatureSelector rebuilt(patches, features);
+  for (int f = 0; f < (int)(features.size()); f++) {
+    const float* responses = selector.store.responses(f);
+    const int* sorted = selector.store.sorted(f);
+    const float* rebuilt_responses = rebuilt.store.responses(f);
+    const int* rebuilt_sorted = rebuilt.store.sorted(f);
+
+    for (int p = 0; p < (int)(patches.size()); p++) {
+      EXPECT_EQ(rebuilt_responses[p], responses[p]);
+      EXPECT_EQ(rebuilt_responses[rebuilt_sorted[p]], responses[sorted[p]]);
+    }
+  }
+}
+
+TEST_F(FeatureSelectorTest, LazySelectionMatchesFull) {
+  FeatureSelector selector(patches, features);
+  FeatureSelector lazy_selector(patches, features);
+
+  vector<float> weights(patches.size(), 1.0);
+  vector<float> activations(patches.size(), 0.0);
+
+  for (int round = 0; round < 10; round++) {
+    int index, lazy_index;
+    float err, lazy_err;
+    DecisionStump stump = selector.SelectFeature(weights, activations, &index, &err);
+    DecisionStump lazy_stump = lazy_selector.SelectFeatureLazy(weights, activations, &lazy_index, &lazy_err);
+
+    EXPECT_EQ(index, lazy_index);
+    EXPECT_EQ(err, lazy_err);
+    EXPECT_EQ(stump.split_, lazy_stump.split_);
+    EXPECT_EQ(stump.sign_, lazy_stump.sign_);
+
+    // The bounds don't assume any particular update, so just perturb the weights.
+    for (int p = 0; p < (int)(weights.size()); p++) {
+      weights[p] *= 0.8 + 0.4 * (float)rand() / (float)RAND_MAX;
+    }
+  }
+}
+
+TEST_F(FeatureSelectorTest, BanditSelection) {
+  FeatureSelector selector(patches, features);
+
+  vector<float> weights(patches.size(), 1.0);
+  vector<float> activations(patches.size(), 0.0);
+
+  int index, bandit_index;
+  float err, bandit_err;
+  DecisionStump stump = selector.SelectFeature(weights, activations, &index, &err);
+
+  // With a sample as large as the training set it is just the full search.
+  FLAGS_bandit_initial_samples = patches.size();
+  DecisionStump bandit_stump = selector.SelectFeatureBandit(weights, activations, &bandit_index, &bandit_err);
+  EXPECT_EQ(index, bandit_index);
+  EXPECT_EQ(err, bandit_err);
+  EXPECT_EQ(stump.split_, bandit_stump.split_);
+
+  // Otherwise it should still find a feature that is nearly as good.
+  FLAGS_bandit_initial_samples = 50;
+  FLAGS_bandit_final_features = 4;
+  selector.SelectFeatureBandit(weights, activations, &bandit_index, &bandit_err);
+  EXPECT_GE(bandit_err, err);
+  EXPECT_LT(bandit_err, err + 0.1);
+
+  FLAGS_bandit_initial_samples = 1000;
+  FLAGS_bandit_final_features = 16;
+}
+
+TEST_F(FeatureSelectorTest, SubsetSelection) {
+  FeatureSelector selector(patches, features);
+
+  vector<float> weights(patches.size());
+  vector<float> activations(patches.size(), 0.0);
+  for (unsigned int p = 0; p < weights.size(); p++) {
+    weights[p] = (float)(rand() % 100 + 1);
+  }
+
+  // Selecting on everything is the same as the full search.
+  vector<int> subset;
+  vector<float> subset_weights;
+  GossSample(weights, 1.0, 0.0, &subset, &subset_weights);
+  ASSERT_EQ(weights.size(), subset.size());
+
+  int index, subset_index;
+  float err, subset_err;
+  DecisionStump stump = selector.SelectFeature(weights, activations, &index, &err);
+  DecisionStump subset_stump = selector.SelectFeatureSubset(subset, subset_weights, &subset_index, &subset_err);
+  EXPECT_EQ(index, subset_index);
+  EXPECT_FLOAT_EQ(err, subset_err);
+  EXPECT_EQ(stump.split_, subset_stump.split_);
+
+  // The largest weights are always kept, the rest are scaled up.
+  GossSample(weights, 0.2, 0.1, &subset, &subset_weights);
+  EXPECT_EQ(150, (int)(subset.size()));
+
+  vector<float> sorted_weights(weights);
+  sort(sorted_weights.rbegin(), sorted_weights.rend());
+  float top_threshold = sorted_weights[99];
+
+  int num_top = 0;
+  for (unsigned int k = 0; k < subset.size(); k++) {
+    if (subset_weights[k] == weights[subset[k]]) {
+      num_top++;
+      EXPECT_GE(weights[subset[k]], top_threshold);
+    } else {
+      EXPECT_FLOAT_EQ(8.0 * weights[subset[k]], subset_weights[k]);
+    }
+  }
+  EXPECT_EQ(100, num_top);
+}
+
+TEST_F(FeatureSelectorTest, TrimmedSelection) {
+  FeatureSelector selector(patches, features);
+
+  vector<float> weights(patches.size());
+  vector<float> activations(patches.size(), 0.0);
+  float total_weight = 0.0;
+  for (unsigned int p = 0; p < weights.size(); p++) {
+    weights[p] = exp((float)(rand() % 100) / 10.0);
+    total_weight += weights[p];
+  }
+
+  vector<int> active;
+  TrimWeights(weights, 0.05, &active);
+  ASSERT_LT(active.size(), weights.size());
+
+  // Only a small fraction of the weight is trimmed.
+  vector<float> trimmed_weights(weights.size(), 0.0);
+  float active_weight = 0.0;
+  for (unsigned int k = 0; k < active.size(); k++) {
+    trimmed_weights[active[k]] = weights[active[k]];
+    active_weight += weights[active[k]];
+  }
+  EXPECT_GE(active_weight, 0.95 * total_weight);
+
+  // Selecting on the active examples is the same as giving the rest zero weight.
+  int index, trimmed_index;
+  float err, trimmed_err;
+  selector.SelectFeature(trimmed_weights, activations, &index, &err);
+
+  selector.SetActiveExamples(active);
+  EXPECT_EQ((int)(active.size()), selector.num_active());
+  selector.SelectFeature(weights, activations, &trimmed_index, &trimmed_err);
+  EXPECT_EQ(index, trimmed_index);
+  EXPECT_FLOAT_EQ(err, trimmed_err);
+
+  selector.ClearActiveExamples();
+  EXPECT_EQ((int)(patches.size()), selector.num_active());
+}
+
+TEST_F(FeatureSelectorTest, UpdateRound) {
+  FeatureSelector selector(patches, features);
+
+  vector<float> sample_weights(patches.size());
+  vector<float> weights(patches.size(), 1.0);
+  vector<float> activations(patches.size(), 0.0);
+  for (unsigned int p = 0; p < patches.size(); p++) {
+    sample_weights[p] = (float)(rand() % 10 + 1);
+  }
+
+  Filter filter;
+  filter.active_ = true;
+  filter.less_ = true;
+  filter.threshold_ = 1.0;
+
+  vector<float> fused_weights(weights);
+  vector<float> fused_activations(activations);
+
+  for (int round = 0; round < 5; round++) {
+    int index;
+    float err;
+    DecisionStump stump = selector.SelectFeature(weights, activations, &index, &err);
+
+    // Keep alpha finite, the fixture's patches are easy to separate.
+    err = max(err, 0.1f);
+    float alpha = 0.5 * log((1 - err) / err);
+
+    selector.UpdateActivations(stump, filter, index, alpha, &activations);
+    Gradient(patches, sample_weights, activations, &weights);
+    float positive_loss, negative_loss;
+    float zero_one_loss = ZeroOneLoss(patches, sample_weights, activations,
+                                      &positive_loss, &negative_loss);
+
+    LossStatistics stats;
+    selector.UpdateRound(stump, filter, index, alpha, sample_weights,
+                         &fused_activations, &fused_weights, &stats);
+
+    for (unsigned int p = 0; p < patches.size(); p++) {
+      ASSERT_FLOAT_EQ(activations[p], fused_activations[p]);
+      ASSERT_NEAR(1.0, fused_weights[p] / weights[p], 1e-5);
+    }
+    EXPECT_NEAR(1.0, stats.exp_loss / ExpLoss(patches, sample_weights, activations), 1e-5);
+    EXPECT_FLOAT_EQ(zero_one_loss, stats.zero_one_loss);
+    EXPECT_FLOAT_EQ(positive_loss, stats.positive_loss);
+    EXPECT_FLOAT_EQ(negative_loss, stats.negative_loss);
+  }
+}
+
+TEST_F(FeatureSelectorTest, ActivationCache) {
+  for (unsigned int p = 0; p < patches.size(); p++) {
+    patches[p].set_id(p);
+  }
+
+  // Grow a classifier both ways TrainBoosted does: appending stumps to
+  // the last chain, and adding a filtered chain per stump (anytime).
+  for (int anytime = 0; anytime < 2; anytime++) {
+    Classifier c;
+    c.filters_are_additive_ = (anytime == 0);
+    c.filters_are_permanent_ = (anytime == 0);
+    c.chains_.push_back(Chain());
+    c.filters_.push_back(Filter());
+
+    ActivationCache cache(patches.size() / 2);
+    for (int round = 0; round < 8; round++) {
+      const Feature& f = features[(round * 7) % features.size()];
+      c.chains_.back().stumps_.push_back(DecisionStump(f, 0.1 * round, (round % 2) ? 1.0 : -1.0));
+      c.chains_.back().weights_.push_back(0.5 + 0.1 * round);
+
+      Filter filter;
+      filter.active_ = (round % 3 != 0);
+      filter.less_ = (round % 2 == 0);
+      filter.threshold_ = 0.25 * (round % 4);
+      if (anytime) {
+        c.filters_.back() = filter;
+        c.chains_.push_back(Chain());
+        c.filters_.push_back(Filter());
+      } else if (round % 3 == 2) {
+        c.chains_.push_back(Chain());
+        c.filters_.push_back(filter);
+      }
+
+      for (unsigned int p = 0; p < patches.size(); p++) {
+        ASSERT_EQ(c.Activation(patches[p]), cache.Activation(patches[p], c));
+      }
+    }
+    EXPECT_EQ(patches.size() / 2, cache.size());
+  }
+}
+
+TEST_F(FeatureSelectorTest, ActivationCacheStreamed) {
+  // Patch files keep 8 bit pixels, so write fresh ones in [0, 1].
+  const string kFilenames[2] = {FLAGS_test_output_directory + "/cache_negatives.sbpf",
+                                FLAGS_test_output_directory + "/cache_positives.sbpf"};
+  for (int label = 0; label < 2; label++) {
+    PatchFileWriter writer;
+    ASSERT_TRUE(writer.Open(kFilenames[label], 10, 10, 1, PatchFile::kFileLabel, label));
+    for (int i = 0; i < 50; i++) {
+      Patch p(label, 10, 10, 1);
+      for (int w = 0; w < p.width(); w++) {
+        for (int h = 0; h < p.height(); h++) {
+          p.SetValue(w, h, 0, ((rand() % 4) + (label && w < 5)) / 4.0);
+        }
+      }
+      EXPECT_TRUE(writer.Write(p));
+    }
+    ASSERT_TRUE(writer.Close());
+  }
+
+  FLAGS_activation_cache = true;
+  DataSource data(kFilenames[1], kFilenames[0]);
+  FLAGS_activation_cache = false;
+  ASSERT_TRUE(data.activation_cache() != NULL);
+
+  for (int i = 0; i < 60; i++) {
+    Patch p;
+    ASSERT_TRUE(data.ReadPositivePatch(&p));
+    EXPECT_GE(p.id(), 0);
+    ASSERT_TRUE(data.ReadNegativePatch(&p));
+    EXPECT_GE(p.id(), 0);
+  }
+
+  // Both files are read more than once per sample, so records repeat.
+  data.set_num_positives_to_sample(200);
+  data.set_num_negatives_to_sample(200);
+  Classifier c;
+  c.chains_.push_back(Chain());
+  c.filters_.push_back(Filter());
+  c.chains_[0].stumps_.push_back(DecisionStump(features[0], 0.5, 1.0));
+  c.chains_[0].weights_.push_back(0.5);
+
+  vector<float> weights;
+  vector<Patch> sampled;
+  ASSERT_GT(data.GetPatchesSampled(100, c, &weights, &sampled), 0);
+  EXPECT_GT(data.activation_cache()->hits(), 0u);
+  EXPECT_EQ(100u, data.activation_cache()->size());
+}
+
+TEST_F(FeatureSelectorTest, ResamplingPool) {
+  vector<Patch> positives, negatives;
+  for (unsigned int p = 0; p < patches.size(); p++) {
+    (patches[p].label() > 0 ? positives : negatives).push_back(patches[p]);
+  }
+  const string kPositives = FLAGS_test_output_directory + "/pool_positives";
+  const string kNegatives = FLAGS_test_output_directory + "/pool_negatives";
+  DataSource::WritePatchesToFile(kPositives, positives);
+  DataSource::WritePatchesToFile(kNegatives, negatives);
+
+  FLAGS_resample_pool_size = 300;
+  DataSource data(kPositives, kNegatives);
+  FLAGS_resample_pool_size = 0;
+
+  Classifier c;
+  c.chains_.push_back(Chain());
+  c.filters_.push_back(Filter());
+  for (int round = 0; round < 3; round++) {
+    c.chains_[0].stumps_.push_back(DecisionStump(features[round], 0.5, 1.0));
+    c.chains_[0].weights_.push_back(0.5);
+
+    vector<float> weights;
+    vector<Patch> sampled;
+    int num_sampled = data.GetPatchesSampled(100, c, &weights, &sampled);
+    ASSERT_GT(num_sampled, 0);
+    ASSERT_LE(num_sampled, 100);
+    ASSERT_EQ(num_sampled, (int)sampled.size());
+    ASSERT_EQ(sampled.size(), weights.size());
+
+    // Each weight is hits / exp(-y f(x)), and there are 100 hits in all.
+    float hits = 0.0;
+    for (unsigned int p = 0; p < sampled.size(); p++) {
+      float y = (sampled[p].label() > 0) ? 1.0 : -1.0;
+      float h = weights[p] * exp(-y * c.Activation(sampled[p]));
+      EXPECT_NEAR(h, floor(h + 0.5), 1e-3);
+      hits += h;
+    }
+    EXPECT_NEAR(100.0, hits, 1e-2);
+
+    // Each label is drawn from its own pool, which stays resident.
+    for (int label = 1; label >= 0; label--) {
+      weights.clear();
+      sampled.clear();
+      if (label) {
+        ASSERT_GT(data.GetPositivePatchesSampled(50, c, &weights, &sampled), 0);
+      } else {
+        ASSERT_GT(data.GetNegativePatchesSampled(50, c, &weights, &sampled), 0);
+      }
+      for (unsigned int p = 0; p < sampled.size(); p++) {
+        EXPECT_EQ(label, sampled[p].label());
+      }
+    }
+  }
+}
@@ -8,9 +8,23 @@
 #include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <utility>
+#include <vector>
 
 #include "common.h"
+#include "data_source.h"
+#include "frame_set.h"
 #include "patch.h"
+#include "patch_batch.h"
+#include "patch_dataset.h"
+#include "patch_file.h"
+#include "patch_reader.h"
+#include "patch_stream.h"
+#include "proto_patch_file.h"
+#include "shuffle_buffer.h"
 #include "patch.pb.h"
 
 using namespace std;
@@ -108,3 +122,463 @@ TEST_F(PatchTest, ReadWriteTest) {
     }
   }
 }
+
+TEST_F(PatchTest, MoveTest) {
+  Patch moved(std::move(original));
+  EXPECT_EQ(original.width(), 0);
+  EXPECT_EQ(moved.width(), 10);
+  EXPECT_FLOAT_EQ(moved.Value(3, 4, 1), 2.0 * (3 * 10 + 4));
+
+  Patch assigned;
+  assigned = std::move(moved);
+  EXPECT_EQ(moved.width(), 0);
+  EXPECT_EQ(assigned.channels(), 2);
+  EXPECT_FLOAT_EQ(assigned.Value(3, 4, 1), 2.0 * (3 * 10 + 4));
+
+  assigned.Reset(1, 4, 5, 1);
+  EXPECT_EQ(assigned.label(), 1);
+  EXPECT_EQ(assigned.width(), 4);
+  EXPECT_EQ(assigned.height(), 5);
+  EXPECT_FLOAT_EQ(assigned.Value(3, 4, 0), 0.0);
+}
+
+TEST_F(PatchTest, BatchTest) {
+  PatchBatch batch;
+  batch.Reserve(30);
+  for (int i = 0; i < 40; i++) {
+    Patch p = original;
+    p.set_label((i % 2 == 0) ? 1 : -1);
+    p.SetValue(i % 10, 0, 1, -1.0 * i);
+    batch.Append(p);
+  }
+
+  EXPECT_EQ(batch.size(), 40);
+  EXPECT_EQ(batch.pixels(), 200);
+
+  // Switching layouts should leave every value in place.
+  batch.SetLayout(PatchBatch::kPixelMajor);
+  batch.SetLayout(PatchBatch::kPatchMajor);
+  batch.SetLayout(PatchBatch::kPixelMajor);
+  for (int i = 0; i < batch.size(); i++) {
+    EXPECT_EQ(batch.label(i), (i % 2 == 0) ? 1 : -1);
+    EXPECT_FLOAT_EQ(batch.Value(i, i % 10, 0, 1), -1.0 * i);
+    EXPECT_FLOAT_EQ(batch.Pixel(i % 10, 0, 1)[i], -1.0 * i);
+
+    Patch copy;
+    batch.Get(i, &copy);
+    EXPECT_EQ(copy.label(), batch.label(i));
+    for (int w = 0; w < copy.width(); w++) {
+      for (int h = 0; h < copy.height(); h++) {
+        for (int c = 0; c < copy.channels(); c++) {
+          EXPECT_FLOAT_EQ(copy.Value(w, h, c), batch.Value(i, w, h, c));
+        }
+      }
+    }
+  }
+
+  batch.Set(5, original);
+  EXPECT_EQ(batch.label(5), original.label());
+  EXPECT_FLOAT_EQ(batch.Value(5, 5, 0, 1), original.Value(5, 0, 1));
+  EXPECT_FLOAT_EQ(batch.Value(6, 6, 0, 1), -6.0);
+}
+
+TEST_F(PatchTest, ReaderTest) {
+  // Three files of patches, each tagged with its index in pixel (0, 0).
+  vector<string> filenames;
+  for (int f = 0; f < 3; f++) {
+    stringstream ss;
+    ss << FLAGS_test_output_directory << "/patch_reader_test." << f;
+    filenames.push_back(ss.str());
+
+    ofstream out(filenames.back().c_str(), ofstream::out | ofstream::trunc);
+    for (int i = 0; i < 50; i++) {
+      Patch p = original;
+      p.SetValue(0, 0, 0, 50 * f + i);
+      p.Write(out);
+    }
+    out.close();
+  }
+
+  map<string, int> file_numbers;
+  for (int f = 0; f < 3; f++) {
+    file_numbers[filenames[f]] = f;
+  }
+
+  // With one thread, the first pass has every patch exactly once.
+  PatchReader reader(filenames, file_numbers, 1, 16);
+  vector<int> seen(150, 0);
+  set<int64_t> ids;
+  for (int i = 0; i < 150; i++) {
+    Patch p;
+    ASSERT_TRUE(reader.Read(&p));
+    EXPECT_EQ(p.width(), original.width());
+
+    // Read patches come back integrated, so (0, 0) is unchanged.
+    int index = (int)(p.Value(0, 0, 0) + 0.5);
+    ASSERT_GE(index, 0);
+    ASSERT_LT(index, 150);
+    seen[index]++;
+
+    // The id carries the file number through the queue.
+    ASSERT_GE(p.id(), 0);
+    EXPECT_GE(p.id(), PatchStream::RecordId(index / 50, 0));
+    EXPECT_LT(p.id(), PatchStream::RecordId(index / 50 + 1, 0));
+    ids.insert(p.id());
+  }
+  EXPECT_EQ(ids.size(), 150u);
+
+  for (int i = 0; i < 150; i++) {
+    EXPECT_EQ(seen[i], 1) << "patch " << i;
+  }
+
+  vector<string> missing(1, FLAGS_test_output_directory + "/patch_reader_test.missing");
+  PatchReader empty(missing, map<string, int>(), 2, 16);
+  Patch p;
+  EXPECT_FALSE(empty.Read(&p));
+}
+
+TEST_F(PatchTest, ShuffleBufferTest) {
+  // Three patch files, each patch tagged with its record in pixel (0, 0).
+  vector<string> filenames;
+  map<string, int> file_numbers;
+  for (int f = 0; f < 3; f++) {
+    stringstream ss;
+    ss << FLAGS_test_output_directory << "/shuffle_buffer_test." << f;
+    filenames.push_back(ss.str());
+    file_numbers[ss.str()] = f;
+
+    PatchFileWriter writer;
+    ASSERT_TRUE(writer.Open(filenames.back(), original.width(), original.height(),
+                            original.channels(), PatchFile::kRecordLabels));
+    for (int i = 0; i < 50; i++) {
+      Patch p = original;
+      p.SetValue(0, 0, 0, i / 255.0);
+      EXPECT_TRUE(writer.Write(p));
+    }
+    ASSERT_TRUE(writer.Close());
+  }
+
+  ShuffleBuffer buffer(filenames, file_numbers, 3, 20);
+  EXPECT_EQ(buffer.num_shards(), 3);
+
+  int previous_file = -1;
+  size_t previous_record = 0;
+  int in_order = 0;
+  for (int i = 0; i < 150; i++) {
+    Patch p;
+    ASSERT_TRUE(buffer.Read(&p));
+
+    // The id says which file and record the patch came from.
+    size_t record = (size_t)(p.Value(0, 0, 0) * 255.0 + 0.5);
+    ASSERT_LT(record, 50u);
+    int file_number = -1;
+    for (int f = 0; f < 3; f++) {
+      if (p.id() == PatchStream::RecordId(f, record)) {
+        file_number = f;
+      }
+    }
+    ASSERT_GE(file_number, 0) << "id " << p.id();
+
+    in_order += (file_number == previous_file && record == previous_record + 1);
+    previous_file = file_number;
+    previous_record = record;
+  }
+  EXPECT_EQ(buffer.size(), 20);
+
+  // Reading straight through the files would have 147 in order.
+  EXPECT_LT(in_order, 50);
+
+  vector<string> missing(1, FLAGS_test_output_directory + "/shuffle_buffer_test.missing");
+  ShuffleBuffer empty(missing, file_numbers, 3, 20);
+  Patch p;
+  EXPECT_FALSE(empty.Read(&p));
+}
+
+TEST_F(PatchTest, PrefetchTest) {
+  const string kFilename = FLAGS_test_output_directory + "/prefetch_test";
+  int patch_width = FLAGS_patch_width;
+  int patch_height = FLAGS_patch_height;
+  int patch_depth = FLAGS_patch_depth;
+  FLAGS_patch_width = original.width();
+  FLAGS_patch_height = original.height();
+  FLAGS_patch_depth = original.channels();
+
+  // One file, so the stream order is the file order every pass.
+  vector<Patch> patches;
+  for (int i = 0; i < 30; i++) {
+    patches.push_back(original);
+    patches.back().SetValue(0, 0, 0, i);
+  }
+  DataSource::WritePatchesToFile(kFilename, patches);
+
+  // Several buffer swaps, and several passes through the file.
+  DataSource streamed(kFilename, kFilename);
+  DataSource prefetched(kFilename, kFilename);
+  prefetched.StartPrefetch(7);
+  for (int i = 0; i < 100; i++) {
+    Patch expected, p;
+    ASSERT_TRUE(streamed.ReadPositivePatch(&expected));
+    ASSERT_TRUE(prefetched.ReadPositivePatch(&p));
+    EXPECT_EQ(expected.Value(0, 0, 0), p.Value(0, 0, 0)) << "patch " << i;
+    EXPECT_TRUE(p.is_integral());
+
+    ASSERT_TRUE(streamed.ReadNegativePatch(&expected));
+    ASSERT_TRUE(prefetched.ReadNegativePatch(&p));
+    EXPECT_EQ(expected.Value(0, 0, 0), p.Value(0, 0, 0)) << "patch " << i;
+  }
+
+  // Stopping mid buffer shouldn't wait for the buffer to fill.
+  DataSource* stopped = new DataSource(kFilename, kFilename);
+  stopped->StartPrefetch(100000000);
+  delete stopped;
+
+  FLAGS_patch_width = patch_width;
+  FLAGS_patch_height = patch_height;
+  FLAGS_patch_depth = patch_depth;
+}
+
+TEST_F(PatchTest, PatchFileTest) {
+  const string kFilename = FLAGS_test_output_directory + "/patch_file_test";
+
+  // Scale into [0, 1], the range of image patches.
+  Patch scaled(original);
+  for (int w = 0; w < scaled.width(); w++) {
+    for (int h = 0; h < scaled.height(); h++) {
+      for (int c = 0; c < scaled.channels(); c++) {
+        scaled.SetValue(w, h, c, original.Value(w, h, c) / 200.0);
+      }
+    }
+  }
+
+  PatchFileWriter writer;
+  ASSERT_TRUE(writer.Open(kFilename, 10, 10, 2, PatchFile::kRecordLabels));
+  for (int i = 0; i < 5; i++) {
+    scaled.set_label(i % 2);
+    EXPECT_TRUE(writer.Write(scaled));
+  }
+  EXPECT_FALSE(writer.Write(Patch(0, 5, 5, 2)));
+  ASSERT_TRUE(writer.Close());
+
+  EXPECT_TRUE(PatchFile::IsPatchFile(kFilename));
+
+  PatchFile file;
+  ASSERT_TRUE(file.Open(kFilename));
+  ASSERT_EQ(file.size(), 5u);
+  EXPECT_EQ(file.width(), 10);
+  EXPECT_EQ(file.height(), 10);
+  EXPECT_EQ(file.depth(), 2);
+
+  for (int i = 4; i >= 0; i--) {
+    Patch p;
+    file.Read(i, &p);
+    EXPECT_EQ(p.label(), i % 2);
+    EXPECT_EQ(file.Label(i), i % 2);
+    for (int w = 0; w < p.width(); w++) {
+      for (int h = 0; h < p.height(); h++) {
+        for (int c = 0; c < p.channels(); c++) {
+          EXPECT_NEAR(scaled.Value(w, h, c), p.Value(w, h, c), 0.5 / 255.0 + 1e-6);
+        }
+      }
+    }
+  }
+  // The same patches stored as integral images.
+  const string kIntegralFilename = FLAGS_test_output_directory + "/patch_file_test.integral";
+  ASSERT_TRUE(writer.Open(kIntegralFilename, 10, 10, 2, PatchFile::kRecordLabels, 0, true));
+  for (int i = 0; i < 5; i++) {
+    scaled.set_label(i % 2);
+    EXPECT_TRUE(writer.Write(scaled));
+  }
+  ASSERT_TRUE(writer.Close());
+
+  PatchFile integral_file;
+  ASSERT_TRUE(integral_file.Open(kIntegralFilename));
+  EXPECT_TRUE(integral_file.integral());
+  EXPECT_FALSE(file.integral());
+
+  for (int i = 0; i < 5; i++) {
+    Patch pixels, integral;
+    file.Read(i, &pixels);
+    integral_file.Read(i, &integral);
+    EXPECT_FALSE(pixels.is_integral());
+    EXPECT_TRUE(integral.is_integral());
+    EXPECT_EQ(integral.label(), i % 2);
+
+    pixels.ComputeIntegralImage();
+    for (int w = 0; w < pixels.width(); w++) {
+      for (int h = 0; h < pixels.height(); h++) {
+        for (int c = 0; c < pixels.channels(); c++) {
+          EXPECT_NEAR(pixels.Value(w, h, c), integral.Value(w, h, c), 1e-4);
+        }
+      }
+    }
+  }
+}
+
+TEST_F(PatchTest, ProtoPatchFileTest) {
+  const string kFilename = FLAGS_test_output_directory + "/proto_patch_file_test";
+
+  ofstream out(kFilename.c_str(), ofstream::out | ofstream::trunc);
+  for (int i = 0; i < 6; i++) {
+    Patch p = original;
+    p.set_label(i % 3);
+    p.SetValue(1, 2, 1, i);
+    if (i == 4) {
+      p.ComputeIntegralImage();
+    }
+    p.Write(out);
+  }
+  out.close();
+
+  ProtoPatchFile file;
+  ASSERT_TRUE(file.Open(kFilename));
+
+  // Sequential reads match Patch::Read.
+  ifstream in(kFilename.c_str(), ifstream::in);
+  size_t offset = 0;
+  for (int i = 0; i < 6; i++) {
+    Patch expected, mapped;
+    ASSERT_TRUE(expected.Read(in));
+    ASSERT_TRUE(file.ReadAt(&offset, &mapped));
+
+    EXPECT_EQ(expected.label(), mapped.label());
+    EXPECT_EQ(expected.is_integral(), mapped.is_integral());
+    EXPECT_EQ(i == 4, mapped.is_integral());
+    ASSERT_EQ(expected.width(), mapped.width());
+    ASSERT_EQ(expected.height(), mapped.height());
+    ASSERT_EQ(expected.channels(), mapped.channels());
+    for (int w = 0; w < mapped.width(); w++) {
+      for (int h = 0; h < mapped.height(); h++) {
+        for (int c = 0; c < mapped.channels(); c++) {
+          EXPECT_EQ(expected.Value(w, h, c), mapped.Value(w, h, c));
+        }
+      }
+    }
+  }
+  in.close();
+
+  Patch p;
+  EXPECT_FALSE(file.ReadAt(&offset, &p));
+
+  // Indexed reads.
+  ASSERT_EQ(file.BuildIndex(), 6u);
+  vector<Patch> range;
+  EXPECT_EQ(file.ReadRange(2, 5, &range), 3);
+  ASSERT_EQ(range.size(), 3u);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(range[i].label(), (i + 2) % 3);
+  }
+  EXPECT_FLOAT_EQ(range[1].Value(1, 2, 1), 3.0);
+}
+
+TEST_F(PatchTest, DatasetTest) {
+  const string kProtoFilename = FLAGS_test_output_directory + "/dataset_test.pb";
+  const string kPatchFilename = FLAGS_test_output_directory + "/dataset_test.sbpf";
+
+  ofstream out(kProtoFilename.c_str(), ofstream::out | ofstream::trunc);
+  for (int i = 0; i < 3; i++) {
+    Patch p = original;
+    p.SetValue(0, 0, 0, i);
+    p.Write(out);
+  }
+  out.close();
+
+  PatchFileWriter writer;
+  ASSERT_TRUE(writer.Open(kPatchFilename, original.width(), original.height(),
+                          original.channels(), PatchFile::kRecordLabels));
+  for (int i = 3; i < 7; i++) {
+    Patch p = original;
+    p.SetValue(0, 0, 0, i / 255.0);
+    EXPECT_TRUE(writer.Write(p));
+  }
+  ASSERT_TRUE(writer.Close());
+
+  vector<string> filenames;
+  filenames.push_back(kProtoFilename);
+  filenames.push_back(kPatchFilename);
+
+  // Build the index on the first open, load the sidecar on the second.
+  remove((kProtoFilename + ".index").c_str());
+  for (int pass = 0; pass < 2; pass++) {
+    PatchDataset dataset;
+    ASSERT_TRUE(dataset.Open(filenames));
+    ASSERT_EQ(dataset.size(), 7u);
+    EXPECT_EQ(dataset.num_files(), 2);
+
+    for (int i = 6; i >= 0; i--) {
+      Patch p;
+      ASSERT_TRUE(dataset.Read(i, &p));
+      float expected = (i < 3) ? i : i / 255.0;
+      EXPECT_NEAR(p.Value(0, 0, 0), expected, 1e-6);
+    }
+
+    Patch p;
+    EXPECT_TRUE(dataset.ReadRandom(&p));
+  }
+}
+
+TEST_F(PatchTest, FrameSetTest) {
+  const string kFilename = FLAGS_test_output_directory + "/frame_set_test";
+  int patch_width = FLAGS_patch_width;
+  int patch_height = FLAGS_patch_height;
+  int patch_depth = FLAGS_patch_depth;
+  FLAGS_patch_width = 6;
+  FLAGS_patch_height = 5;
+  FLAGS_patch_depth = 1;
+
+  vector<Patch> frames;
+  vector< vector<Label> > labels;
+  for (int f = 0; f < 2; f++) {
+    frames.push_back(Patch(0, 30, 20, 1));
+    for (int x = 0; x < 30; x++) {
+      for (int y = 0; y < 20; y++) {
+        frames.back().SetValue(x, y, 0, (x * 7 + y * 3 + f) % 11);
+      }
+    }
+    labels.push_back(vector<Label>());
+    labels.back().push_back(Label(2 + f, 3, 12, 10));
+  }
+  DataSource::WriteLabeledPatchesToFile(kFilename, frames, labels);
+
+  FrameSet set;
+  vector<string> filenames(1, kFilename);
+  ASSERT_TRUE(set.Load(filenames, 1.0, 2, 2.0, 0.2));
+  EXPECT_EQ(set.num_frames(), 2);
+  EXPECT_EQ(set.num_levels(), 4);
+  ASSERT_EQ(set.positives().size(), 2u);
+  EXPECT_EQ(set.positives()[0].label(), 1);
+  EXPECT_TRUE(set.positives()[0].is_integral());
+
+  // 25x16 windows at full scale, 10x6 at half scale, per frame.
+  ASSERT_EQ(set.num_windows(), 2 * (25 * 16 + 10 * 6));
+
+  // Full scale windows match the patch extracted there and integrated.
+  int num_negatives = 0;
+  for (int ay = 0; ay < 16; ay++) {
+    for (int ax = 0; ax < 25; ax++) {
+      Patch window;
+      if (!set.Window(ay * 25 + ax, &window)) {
+        // Only windows near the label are skipped.
+        EXPECT_TRUE(ax < 14 && ay < 13);
+        continue;
+      }
+      num_negatives++;
+      EXPECT_TRUE(window.is_integral());
+      EXPECT_EQ(window.label(), 0);
+
+      Patch expected(0, 6, 5, 1);
+      frames[0].ExtractLabel(Label(ax, ay, 6, 5), &expected);
+      expected.ComputeIntegralImage();
+      for (int x = 0; x < 6; x++) {
+        for (int y = 0; y < 5; y++) {
+          EXPECT_NEAR(expected.Value(x, y, 0), window.Value(x, y, 0), 1e-3);
+        }
+      }
+    }
+  }
+  EXPECT_GT(num_negatives, 25 * 16 / 2);
+  EXPECT_LT(num_negatives, 25 * 16);
+
+  FLAGS_patch_width = patch_width;
+  FLAGS_patch_height = patch_height;
+  FLAGS_patch_depth = patch_depth;
+}